@@ -0,0 +1,588 @@
+/* Empirical complexity estimation.
+ *
+ * An operation is timed on queues whose length doubles from MIN_SIZE to
+ * MAX_SIZE, leaving out the time spent in the allocations and frees of the
+ * harness. Every model t(n) = a + f(n) * (b + c * v(n)) is fitted to the
+ * median timings by least squares on relative errors, where v(n) is the cost
+ * of a step of a visit of the queue, which rises as it outgrows the caches.
+ * The simplest model within 2 units of Akaike information criterion of the
+ * best is chosen. Its confidence is how often it is still chosen when the
+ * runs at each length are resampled.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "complexity.h"
+#include "queue.h"
+#include "report.h"
+
+#define MIN_SIZE 256
+#define MAX_SIZE (1 << 17)
+#define REPEATS 5
+#define BATCH 64
+#define VISITS 3
+#define RESAMPLES 200
+
+/* Time the operation again, up to ATTEMPTS times in all, while the model
+ * chosen has a confidence below CONFIDENT
+ */
+#define ATTEMPTS 3
+#define CONFIDENT 0.9
+
+/* Stop growing the queue once a run takes this long, as a quadratic
+ * operation would take four times longer at the next length.
+ */
+#define STOP_NS 50e6
+
+/* Fewest lengths to fit the models to */
+#define MIN_POINTS 4
+
+/* Least cost of a step of a model, relative to a step of the visit */
+#define MIN_STEP 0.125
+
+/* Length of the random strings, terminator included */
+#define STRING_SIZE 8
+
+typedef struct {
+    const char *name;  /* As given on the command line */
+    const char *label; /* As printed */
+    double (*f)(double n);
+} model_t;
+
+static double model_1(double n)
+{
+    return 1;
+}
+
+static double model_log_n(double n)
+{
+    return log2(n);
+}
+
+static double model_n(double n)
+{
+    return n;
+}
+
+static double model_n_log_n(double n)
+{
+    return n * log2(n);
+}
+
+static double model_n2(double n)
+{
+    return n * n;
+}
+
+static const model_t models[] = {
+    {"1", "O(1)", model_1},
+    {"logn", "O(log n)", model_log_n},
+    {"n", "O(n)", model_n},
+    {"nlogn", "O(n log n)", model_n_log_n},
+    {"n2", "O(n^2)", model_n2},
+};
+
+#define N_MODELS (sizeof(models) / sizeof(models[0]))
+
+const char *complexity_models = "1 logn n nlogn n2";
+
+/* A run makes a single call on the whole queue, or BATCH calls on single
+ * elements, removing ones taking BATCH extra elements to remove.
+ */
+typedef enum { OP_WHOLE, OP_BATCH, OP_REMOVE } op_kind_t;
+
+typedef struct {
+    const char *name;
+    op_kind_t kind;
+    bool sorted; /* Sort the queue before the run */
+    void (*run)(struct list_head *q);
+} op_t;
+
+static char strings[BATCH][STRING_SIZE];
+static element_t *removed[BATCH];
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static uint64_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static void random_string(char *s)
+{
+    for (int i = 0; i < STRING_SIZE - 1; i++)
+        s[i] = 'a' + next_random() % 26;
+    s[STRING_SIZE - 1] = '\0';
+}
+
+static void run_ih(struct list_head *q)
+{
+    for (int i = 0; i < BATCH; i++)
+        q_insert_head(q, strings[i]);
+}
+
+static void run_it(struct list_head *q)
+{
+    for (int i = 0; i < BATCH; i++)
+        q_insert_tail(q, strings[i]);
+}
+
+static void run_rh(struct list_head *q)
+{
+    for (int i = 0; i < BATCH; i++)
+        removed[i] = q_remove_head(q, NULL, 0);
+}
+
+static void run_rt(struct list_head *q)
+{
+    for (int i = 0; i < BATCH; i++)
+        removed[i] = q_remove_tail(q, NULL, 0);
+}
+
+static void run_size(struct list_head *q)
+{
+    for (int i = 0; i < BATCH; i++)
+        q_size(q);
+}
+
+static void run_reverse(struct list_head *q)
+{
+    q_reverse(q);
+}
+
+static void run_reverseK(struct list_head *q)
+{
+    q_reverseK(q, 3);
+}
+
+static void run_sort(struct list_head *q)
+{
+    q_sort(q, false);
+}
+
+static void run_swap(struct list_head *q)
+{
+    q_swap(q);
+}
+
+static void run_dedup(struct list_head *q)
+{
+    q_delete_dup(q);
+}
+
+static void run_dm(struct list_head *q)
+{
+    q_delete_mid(q);
+}
+
+static void run_ascend(struct list_head *q)
+{
+    q_ascend(q);
+}
+
+static void run_descend(struct list_head *q)
+{
+    q_descend(q);
+}
+
+static void run_free(struct list_head *q)
+{
+    q_free(q);
+}
+
+static const op_t ops[] = {
+    {"ih", OP_BATCH, false, run_ih},
+    {"it", OP_BATCH, false, run_it},
+    {"rh", OP_REMOVE, false, run_rh},
+    {"rt", OP_REMOVE, false, run_rt},
+    {"size", OP_BATCH, false, run_size},
+    {"reverse", OP_WHOLE, false, run_reverse},
+    {"reverseK", OP_WHOLE, false, run_reverseK},
+    {"sort", OP_WHOLE, false, run_sort},
+    {"swap", OP_WHOLE, false, run_swap},
+    {"dedup", OP_WHOLE, true, run_dedup},
+    {"dm", OP_WHOLE, false, run_dm},
+    {"ascend", OP_WHOLE, false, run_ascend},
+    {"descend", OP_WHOLE, false, run_descend},
+    {"free", OP_WHOLE, false, run_free},
+};
+
+#define N_OPS (sizeof(ops) / sizeof(ops[0]))
+
+const char *complexity_ops =
+    "ih it rh rt size reverse reverseK sort swap dedup dm ascend descend "
+    "free";
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Read the first character of every string in q */
+static int visit(struct list_head *q)
+{
+    int sum = 0;
+    element_t *e;
+    list_for_each_entry (e, q, list)
+        sum += *(volatile char *) e->value;
+    return sum;
+}
+
+/* Time one run of op on a queue of n elements, in nanoseconds per call
+ * outside of the harness, and a visit of the queue, in nanoseconds per
+ * element. Return false if the queue could not be built, or the operation
+ * raised an exception.
+ */
+static bool time_run(const op_t *op, int n, double *ns, double *visit_ns)
+{
+    struct list_head *q = NULL;
+    bool ok = false;
+    int calls = op->kind == OP_WHOLE ? 1 : BATCH;
+    int length = op->kind == OP_REMOVE ? n + BATCH : n;
+
+    for (int i = 0; i < BATCH; i++)
+        random_string(strings[i]);
+    if (exception_setup(true)) {
+        q = q_new();
+        char s[STRING_SIZE];
+        for (int i = 0; q && i < length; i++) {
+            random_string(s);
+            if (!q_insert_head(q, s))
+                break;
+        }
+        if (q && q_size(q) == length) {
+            if (op->sorted)
+                q_sort(q, false);
+
+            /* The fastest visit is the one least disturbed */
+            visit(q);
+            *visit_ns = INFINITY;
+            for (int i = 0; i < VISITS; i++) {
+                double start = now_ns();
+                visit(q);
+                *visit_ns = fmin(*visit_ns, (now_ns() - start) / length);
+            }
+
+            /* Leave freed blocks for the calls to reuse, so that they do not
+             * pay for growing a heap as long as the queue
+             */
+            if (op->kind != OP_WHOLE) {
+                for (int i = 0; i < BATCH; i++)
+                    q_insert_head(q, strings[i]);
+                for (int i = 0; i < BATCH; i++)
+                    q_release_element(q_remove_head(q, NULL, 0));
+            }
+
+            harness_clock_start();
+            double start = now_ns();
+            op->run(q);
+            double end = now_ns();
+            /* Guard the relative errors against a clock too coarse */
+            *ns = fmax((end - start - harness_clock_stop()) / calls, 1);
+            if (op->run == run_free)
+                q = NULL;
+            ok = true;
+        }
+    }
+    exception_cancel();
+    harness_clock_stop(); /* If the run was cut short */
+
+    if (exception_setup(true)) {
+        if (op->kind == OP_REMOVE) {
+            for (int i = 0; i < BATCH; i++) {
+                if (removed[i])
+                    q_release_element(removed[i]);
+            }
+        }
+        q_free(q);
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+    memset(removed, 0, sizeof(removed));
+    return ok;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Median of REPEATS values, which get sorted */
+static double median(double *x)
+{
+    qsort(x, REPEATS, sizeof(double), compare_double);
+    return x[REPEATS / 2];
+}
+
+#define TERMS 3 /* Most terms of a model */
+
+/* Terms of model m at one point: a constant, f(n) steps, and what the steps
+ * pay once the queue outgrows a cache, in proportion to the cost v of a step
+ * of the visit. The constant model has no steps, so its calls pay for the
+ * cache directly.
+ */
+static int terms(const model_t *m, double n, double v, double *x)
+{
+    x[0] = 1;
+    if (m->f == model_1) {
+        x[1] = v;
+        return 2;
+    }
+    x[1] = m->f(n);
+    x[2] = m->f(n) * v;
+    return 3;
+}
+
+/* Solve the k x k system a * c = y by Gaussian elimination. Return false if
+ * it is singular.
+ */
+static bool solve(double a[TERMS][TERMS], double *y, double *c, int k)
+{
+    double scale = 0;
+    for (int i = 0; i < k; i++)
+        scale = fmax(scale, fabs(a[i][i]));
+
+    for (int i = 0; i < k; i++) {
+        int p = i;
+        for (int j = i + 1; j < k; j++) {
+            if (fabs(a[j][i]) > fabs(a[p][i]))
+                p = j;
+        }
+        if (fabs(a[p][i]) <= 1e-12 * scale)
+            return false;
+        for (int j = 0; j < k; j++) {
+            double swap = a[i][j];
+            a[i][j] = a[p][j];
+            a[p][j] = swap;
+        }
+        double swap = y[i];
+        y[i] = y[p];
+        y[p] = swap;
+        for (int j = i + 1; j < k; j++) {
+            double r = a[j][i] / a[i][i];
+            for (int l = i; l < k; l++)
+                a[j][l] -= r * a[i][l];
+            y[j] -= r * y[i];
+        }
+    }
+    for (int i = k - 1; i >= 0; i--) {
+        c[i] = y[i];
+        for (int j = i + 1; j < k; j++)
+            c[i] -= a[i][j] * c[j];
+        c[i] /= a[i][i];
+    }
+    return true;
+}
+
+/* Fit model m to the points with nonnegative coefficients, and return the
+ * sum of squared relative errors. Every subset of the terms is fitted by
+ * least squares, keeping the best fit whose coefficients are all
+ * nonnegative, which is the constrained optimum.
+ */
+static double fit(const model_t *m,
+                  const double *n,
+                  const double *t,
+                  const double *v,
+                  int points,
+                  double *c)
+{
+    double x[32][TERMS], best = INFINITY;
+    int k = 0;
+    for (int i = 0; i < points; i++)
+        k = terms(m, n[i], v[i], x[i]);
+
+    memset(c, 0, TERMS * sizeof(double));
+    for (unsigned set = 1; set < 1u << k; set++) {
+        int idx[TERMS], used = 0;
+        for (int j = 0; j < k; j++) {
+            if (set & (1u << j))
+                idx[used++] = j;
+        }
+
+        double a[TERMS][TERMS] = {{0}}, y[TERMS] = {0}, sol[TERMS];
+        for (int i = 0; i < points; i++) {
+            double w = 1 / (t[i] * t[i]);
+            for (int j = 0; j < used; j++) {
+                y[j] += w * x[i][idx[j]] * t[i];
+                for (int l = 0; l < used; l++)
+                    a[j][l] += w * x[i][idx[j]] * x[i][idx[l]];
+            }
+        }
+        if (!solve(a, y, sol, used))
+            continue;
+
+        bool feasible = true;
+        double coef[TERMS] = {0};
+        for (int j = 0; j < used; j++) {
+            feasible = feasible && sol[j] >= 0;
+            coef[idx[j]] = sol[j];
+        }
+        if (!feasible)
+            continue;
+
+        double rss = 0;
+        for (int i = 0; i < points; i++) {
+            double e = t[i];
+            for (int j = 0; j < k; j++)
+                e -= coef[j] * x[i][j];
+            e /= t[i];
+            rss += e * e;
+        }
+        if (rss < best) {
+            best = rss;
+            memcpy(c, coef, sizeof(coef));
+        }
+    }
+
+    /* Report the cache term of the constant model in the same place */
+    if (m->f == model_1) {
+        c[2] = c[1];
+        c[1] = 0;
+    }
+    return best;
+}
+
+/* Fit every model to the points, filling in rss and c, and return the one
+ * chosen
+ */
+static size_t choose(const double *n,
+                     const double *t,
+                     const double *v,
+                     int points,
+                     double *rss,
+                     double c[][TERMS])
+{
+    double aic[N_MODELS];
+    size_t best = 0;
+    for (size_t i = 0; i < N_MODELS; i++) {
+        rss[i] = fit(&models[i], n, t, v, points, c[i]);
+        int params = models[i].f == model_1 ? 2 : 3;
+        aic[i] = points * log(fmax(rss[i], 1e-12) / points) + 2 * params;
+
+        /* Steps much cheaper than those of a visit fit the drift of a cost
+         * the model does not count, rather than steps of the operation
+         */
+        double step = c[i][1] + c[i][2] * v[points - 1];
+        if (models[i].f != model_1 && step < MIN_STEP * v[points - 1])
+            aic[i] = INFINITY;
+        if (aic[i] < aic[best])
+            best = i;
+    }
+
+    /* Models come simplest first. One within 2 units of the best explains
+     * the timings about as well, so the fewer steps win.
+     */
+    for (size_t i = 0; i < best; i++) {
+        if (aic[i] - aic[best] < 2)
+            return i;
+    }
+    return best;
+}
+
+bool complexity_test(const char *name, const char *expected)
+{
+    const op_t *op = NULL;
+    for (size_t i = 0; i < N_OPS && !op; i++) {
+        if (!strcmp(ops[i].name, name))
+            op = &ops[i];
+    }
+    if (!op) {
+        report(1, "Unknown operation '%s', choose one of: %s", name,
+               complexity_ops);
+        return false;
+    }
+
+    const model_t *want = NULL;
+    for (size_t i = 0; expected && i < N_MODELS && !want; i++) {
+        if (!strcmp(models[i].name, expected))
+            want = &models[i];
+    }
+    if (expected && !want) {
+        report(1, "Unknown model '%s', choose one of: %s", expected,
+               complexity_models);
+        return false;
+    }
+
+    double n[32], t[32], v[32], runs[32][REPEATS], visits[32][REPEATS];
+    double rss[N_MODELS], c[N_MODELS][TERMS];
+    int votes[N_MODELS], points;
+    size_t best;
+    for (int attempt = 1;; attempt++) {
+        points = 0;
+        for (int size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+            for (int r = 0; r < REPEATS; r++) {
+                if (!time_run(op, size, &runs[points][r], &visits[points][r])) {
+                    report(1, "ERROR: Could not time %s on %d elements", name,
+                           size);
+                    return false;
+                }
+            }
+            n[points] = size;
+            t[points] = median(runs[points]);
+            v[points] = median(visits[points]);
+            report(1, "size n=%d ns=%.1f visit_ns=%.2f", size, t[points],
+                   v[points]);
+            if (t[points++] * (op->kind == OP_WHOLE ? 1 : BATCH) > STOP_NS)
+                break;
+        }
+        if (points < MIN_POINTS) {
+            report(1, "ERROR: %s is too slow to time on more than %d lengths",
+                   name, points);
+            return false;
+        }
+
+        best = choose(n, t, v, points, rss, c);
+
+        /* Choose again from medians of runs drawn with replacement */
+        memset(votes, 0, sizeof(votes));
+        for (int i = 0; i < RESAMPLES; i++) {
+            double rt[32], rv[32], drawn_t[REPEATS], drawn_v[REPEATS];
+            double rrss[N_MODELS], rc[N_MODELS][TERMS];
+            for (int j = 0; j < points; j++) {
+                for (int r = 0; r < REPEATS; r++) {
+                    int k = next_random() % REPEATS;
+                    drawn_t[r] = runs[j][k];
+                    drawn_v[r] = visits[j][k];
+                }
+                rt[j] = median(drawn_t);
+                rv[j] = median(drawn_v);
+            }
+            votes[choose(n, rt, rv, points, rrss, rc)]++;
+        }
+        if (attempt == ATTEMPTS || votes[best] >= CONFIDENT * RESAMPLES)
+            break;
+        report(1, "Inconclusive: %s (confidence %.2f), timing %s again",
+               models[best].label, (double) votes[best] / RESAMPLES, name);
+    }
+
+    for (size_t i = 0; i < N_MODELS; i++) {
+        report(1,
+               "model name=%s ns=%.3g+f(n)*(%.3g+%.3g*v) error=%.3f "
+               "confidence=%.3f",
+               models[i].name, c[i][0], c[i][1], c[i][2],
+               sqrt(rss[i] / points), (double) votes[i] / RESAMPLES);
+    }
+
+    report(1, "Estimated complexity of %s: %s (confidence %.2f)", name,
+           models[best].label, (double) votes[best] / RESAMPLES);
+    if (want && want != &models[best]) {
+        report(1, "ERROR: Expected %s", want->label);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef LAB0_COMPLEXITY_H
+#define LAB0_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Empirical complexity estimation of queue operations */
+
+/* Operations which can be timed, separated by spaces */
+extern const char *complexity_ops;
+
+/* Models which can be expected, separated by spaces */
+extern const char *complexity_models;
+
+/* Time queue operation op over growing queue sizes, fit the models to the
+ * timings and report how well each does. When expected is not NULL, fail
+ * unless the model it names fits best.
+ */
+bool complexity_test(const char *op, const char *expected);
+
+#endif /* LAB0_COMPLEXITY_H */
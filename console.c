@@ -9,6 +9,7 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
@@ -54,6 +55,17 @@ static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
 
+/* Per-command time budget in milliseconds, 0 for none, which the program
+ * enforces on the operations a command runs
+ */
+static int time_budget = 0;
+static int cmd_budget = -1; /* Set by the budget command while it runs */
+static int show_time = 0;
+
+/* Wall-clock and CPU time of the last command, in milliseconds */
+static double cmd_wall_time, cmd_cpu_time;
+static unsigned cmd_seq = 0;
+
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
@@ -65,6 +77,8 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+static cmd_observer_t cmd_observer = NULL;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -167,6 +181,18 @@ static void record_error()
     }
 }
 
+static double clock_ms(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1.0E3 + ts.tv_nsec * 1.0E-6;
+}
+
+int cmd_time_budget()
+{
+    return cmd_budget >= 0 ? cmd_budget : time_budget;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
@@ -178,7 +204,20 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        if (cmd_observer)
+            cmd_observer(next_cmd->name);
+        unsigned seq = ++cmd_seq;
+        double wall = clock_ms(CLOCK_MONOTONIC);
+        double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
         ok = next_cmd->operation(argc, argv);
+        /* Commands running other commands, like time, are not timed */
+        if (seq == cmd_seq) {
+            cmd_cpu_time = clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+            cmd_wall_time = clock_ms(CLOCK_MONOTONIC) - wall;
+            if (show_time)
+                report(1, "Wall time = %.3f ms, CPU time = %.3f ms",
+                       cmd_wall_time, cmd_cpu_time);
+        }
         if (!ok)
             record_error();
     } else {
@@ -206,6 +245,12 @@ static bool interpret_cmd(char *cmdline)
     return ok;
 }
 
+/* Set function to be told the name of every command before it runs */
+void set_cmd_observer(cmd_observer_t observer)
+{
+    cmd_observer = observer;
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -391,6 +436,20 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static bool do_budget(int argc, char *argv[])
+{
+    int budget;
+    if (argc < 3 || !get_int(argv[1], &budget) || budget < 0) {
+        report(1, "%s takes a budget in ms and a command", argv[0]);
+        return false;
+    }
+
+    cmd_budget = budget;
+    bool ok = interpret_cmda(argc - 2, argv + 2);
+    cmd_budget = -1;
+    return ok;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -430,13 +489,21 @@ void init_cmd()
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(budget, "Run command with a time budget of ms",
+                "ms cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
+    add_param("mblimit", &mblimit,
+              "Memory limit of the program in megabytes (0: none)", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("budget", &time_budget,
+              "Time budget of each command in ms (0: none)", NULL);
+    add_param("showtime", &show_time,
+              "Show wall-clock and CPU time of each command", NULL);
 
     init_in();
     init_time(&last_time);
@@ -56,6 +56,15 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Function told the name of every command about to be executed */
+typedef void (*cmd_observer_t)(const char *name);
+
+/* Set the function to be told about commands, or NULL for none */
+void set_cmd_observer(cmd_observer_t observer);
+
+/* Time budget in milliseconds of the command being executed, 0 for none */
+int cmd_time_budget();
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
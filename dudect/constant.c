@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "constant.h"
@@ -7,12 +8,19 @@
 #include "queue.h"
 #include "random.h"
 
-/* Maintain a queue independent from the qtest since
+/* Maintain queues independent from the qtest since
  * we do not want the test to affect the original functionality
  */
 static struct list_head *l = NULL;
 
-#define dut_new() ((void) (l = q_new()))
+/* One queue per measurement of a batch, kept from one batch to the next.
+ * Every queue gets the length its measurement needs before any of them is
+ * timed, and each timed operation is undone afterwards, instead of building
+ * a queue from scratch and freeing it around every measurement.
+ */
+#define N_FIXTURES (N_MEASURES - 2 * DROP_SIZE)
+
+static struct list_head *fixtures[N_FIXTURES];
 
 #define dut_size(n)                                \
     do {                                           \
@@ -34,8 +42,6 @@ static struct list_head *l = NULL;
             q_insert_tail(l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
-
 static char random_string[N_MEASURES][8];
 static int random_string_iter = 0;
 
@@ -45,12 +51,143 @@ void init_dut(void)
     l = NULL;
 }
 
+void free_dut(void)
+{
+    for (int i = 0; i < N_FIXTURES; i++) {
+        q_free(fixtures[i]);
+        fixtures[i] = NULL;
+    }
+    l = NULL;
+}
+
 static char *get_random_string(void)
 {
     random_string_iter = (random_string_iter + 1) % N_MEASURES;
     return random_string[random_string_iter];
 }
 
+/* Grow or shrink q at the head until it holds n elements */
+static bool dut_resize(struct list_head *q, int n)
+{
+    while (q_size(q) < n) {
+        if (!q_insert_head(q, get_random_string()))
+            return false;
+    }
+    while (q_size(q) > n) {
+        element_t *e = q_remove_head(q, NULL, 0);
+        if (!e)
+            return false;
+        q_release_element(e);
+    }
+    return true;
+}
+
+typedef struct {
+    int length, index;
+} rank_t;
+
+static int rank_cmp(const void *a, const void *b)
+{
+    return ((const rank_t *) a)->length - ((const rank_t *) b)->length;
+}
+
+/* Give the queue of every measurement the length it needs, pairing queues
+ * and lengths in sorted order so that little has to change. This is done
+ * for the whole batch up front: the untimed work just before each timed
+ * call is then the same whichever class the measurement belongs to.
+ */
+static bool dut_prepare(uint8_t *input_data, int mode)
+{
+    rank_t want[N_FIXTURES], have[N_FIXTURES];
+    struct list_head *pool[N_FIXTURES];
+
+    for (int i = 0; i < N_FIXTURES; i++) {
+        if (!fixtures[i] && !(fixtures[i] = q_new()))
+            return false;
+        int n = *(uint16_t *) (input_data + (DROP_SIZE + i) * CHUNK_SIZE) %
+                10000;
+        if (mode == DUT(remove_head) || mode == DUT(remove_tail))
+            n++;
+        want[i] = (rank_t){n, i};
+        have[i] = (rank_t){q_size(fixtures[i]), i};
+        pool[i] = fixtures[i];
+    }
+    qsort(want, N_FIXTURES, sizeof(rank_t), rank_cmp);
+    qsort(have, N_FIXTURES, sizeof(rank_t), rank_cmp);
+
+    for (int i = 0; i < N_FIXTURES; i++) {
+        struct list_head *q = pool[have[i].index];
+        fixtures[want[i].index] = q;
+        if (!dut_resize(q, want[i].length))
+            return false;
+    }
+    return true;
+}
+
+/* Undo an insertion, or redo a removal, at either end of l. Return the
+ * element left over, which is no longer in l.
+ */
+static element_t *dut_undo(int mode, element_t *e)
+{
+    switch (mode) {
+    case DUT(insert_head):
+        return q_remove_head(l, NULL, 0);
+    case DUT(insert_tail):
+        return q_remove_tail(l, NULL, 0);
+    case DUT(remove_head):
+        if (e)
+            q_insert_head(l, e->value);
+        break;
+    case DUT(remove_tail):
+        if (e)
+            q_insert_tail(l, e->value);
+        break;
+    }
+    return e;
+}
+
+static void dut_release(element_t *e)
+{
+    if (e)
+        q_release_element(e);
+}
+
+static void dut_restore(int mode, element_t *e)
+{
+    dut_release(dut_undo(mode, e));
+}
+
+/* Run the operation of mode once untimed and undo it, so that both ends of l
+ * are in the cache whichever class the measurement belongs to.
+ *
+ * An insertion frees its element again right away, so that the timed one
+ * allocates that hot block. A removal allocates nothing, so the element it
+ * leaves over is returned to be freed after the timed call instead: freeing
+ * fills the block, and those stores would still be draining when the timer
+ * starts.
+ */
+static element_t *dut_warm_up(int mode)
+{
+    element_t *e = NULL;
+    switch (mode) {
+    case DUT(insert_head):
+        q_insert_head(l, get_random_string());
+        dut_restore(mode, NULL);
+        return NULL;
+    case DUT(insert_tail):
+        q_insert_tail(l, get_random_string());
+        dut_restore(mode, NULL);
+        return NULL;
+    case DUT(remove_head):
+        e = q_remove_head(l, NULL, 0);
+        break;
+    case DUT(remove_tail):
+        e = q_remove_tail(l, NULL, 0);
+        break;
+    }
+    return dut_undo(mode, e);
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
@@ -75,20 +212,22 @@ bool measure(int64_t *before_ticks,
     assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
            mode == DUT(remove_head) || mode == DUT(remove_tail));
 
+    if (!dut_prepare(input_data, mode))
+        return false;
+
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+            l = fixtures[i - DROP_SIZE];
+            element_t *spare = dut_warm_up(mode);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = cpucycles_begin();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            dut_free();
+            dut_restore(mode, NULL);
+            dut_release(spare);
             if (before_size != after_size - 1)
                 return false;
         }
@@ -96,66 +235,55 @@ bool measure(int64_t *before_ticks,
     case DUT(insert_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+            l = fixtures[i - DROP_SIZE];
+            element_t *spare = dut_warm_up(mode);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = cpucycles_begin();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            dut_free();
+            dut_restore(mode, NULL);
+            dut_release(spare);
             if (before_size != after_size - 1)
                 return false;
         }
         break;
     case DUT(remove_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+            l = fixtures[i - DROP_SIZE];
+            element_t *spare = dut_warm_up(mode);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = cpucycles_begin();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
+            dut_restore(mode, e);
+            dut_release(spare);
             if (before_size != after_size + 1)
                 return false;
         }
         break;
     case DUT(remove_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+            l = fixtures[i - DROP_SIZE];
+            element_t *spare = dut_warm_up(mode);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            before_ticks[i] = cpucycles_begin();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
+            dut_restore(mode, e);
+            dut_release(spare);
             if (before_size != after_size + 1)
                 return false;
         }
         break;
     default:
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
+            l = fixtures[i - DROP_SIZE];
+            before_ticks[i] = cpucycles_begin();
             dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = cpucycles_end();
         }
     }
     return true;
@@ -27,6 +27,7 @@ enum {
 };
 
 void init_dut();
+void free_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
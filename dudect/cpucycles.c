@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "cpucycles.h"
+
+/* Back to back reads of the timer to calibrate it with */
+#define CALIBRATION_READS 10000
+
+int cpucycles_backend = CPUCYCLES_COUNTER;
+int cpucycles_perf_fd = -1;
+cpucycles_calibration_t cpucycles_calibration = {.backend = -1};
+
+static const char *names[CPUCYCLES_BACKENDS] = {
+    [CPUCYCLES_COUNTER] = "cycle counter",
+    [CPUCYCLES_SERIALIZED] = "serialized cycle counter",
+    [CPUCYCLES_PERF] = "perf cycle counter",
+    [CPUCYCLES_CLOCK] = "CLOCK_MONOTONIC_RAW",
+};
+
+/* Count the cycles this thread spends in user space */
+static bool perf_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cpucycles_perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    return cpucycles_perf_fd >= 0;
+}
+
+static void perf_close(void)
+{
+    if (cpucycles_perf_fd >= 0)
+        close(cpucycles_perf_fd);
+    cpucycles_perf_fd = -1;
+}
+
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+bool cpucycles_init(void)
+{
+    if (cpucycles_calibration.backend == cpucycles_backend)
+        return true;
+    if (cpucycles_backend < 0 || cpucycles_backend >= CPUCYCLES_BACKENDS)
+        return false;
+
+    if (cpucycles_backend != CPUCYCLES_PERF)
+        perf_close();
+    else if (cpucycles_perf_fd < 0 && !perf_open())
+        return false;
+
+    int64_t *ticks = malloc(CALIBRATION_READS * sizeof(int64_t));
+    if (!ticks)
+        return false;
+
+    /* The first reads warm up the code and the counter */
+    for (int i = 0; i < CALIBRATION_READS; i++) {
+        int64_t before = cpucycles_begin();
+        ticks[i] = cpucycles_end() - before;
+    }
+    for (int i = 0; i < CALIBRATION_READS; i++) {
+        int64_t before = cpucycles_begin();
+        ticks[i] = cpucycles_end() - before;
+    }
+    qsort(ticks, CALIBRATION_READS, sizeof(int64_t), cmp);
+    int64_t overhead = ticks[0] > 0 ? ticks[0] : 0;
+    int64_t median = ticks[CALIBRATION_READS / 2];
+    for (int i = 0; i < CALIBRATION_READS; i++)
+        ticks[i] = llabs(ticks[i] - median);
+    qsort(ticks, CALIBRATION_READS, sizeof(int64_t), cmp);
+
+    cpucycles_calibration.backend = cpucycles_backend;
+    cpucycles_calibration.overhead = overhead;
+    cpucycles_calibration.median = median;
+    cpucycles_calibration.jitter = ticks[CALIBRATION_READS / 2];
+    free(ticks);
+    return true;
+}
+
+const char *cpucycles_name(void)
+{
+    return names[cpucycles_backend];
+}
+
+const char *cpucycles_unit(void)
+{
+    return cpucycles_backend == CPUCYCLES_CLOCK ? "ns" : "cycles";
+}
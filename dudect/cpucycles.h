@@ -1,7 +1,44 @@
 #ifndef DUDECT_CPUCYCLES_H
 #define DUDECT_CPUCYCLES_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Timers measurements can be taken with */
+enum {
+    CPUCYCLES_COUNTER,    /* Cycle counter, read as it comes */
+    CPUCYCLES_SERIALIZED, /* Cycle counter, fenced around the code measured */
+    CPUCYCLES_PERF,       /* Cycles counted by perf_event_open() */
+    CPUCYCLES_CLOCK,      /* clock_gettime(CLOCK_MONOTONIC_RAW), in ns */
+    CPUCYCLES_BACKENDS,
+};
+
+/* Timer in use, one of the above */
+extern int cpucycles_backend;
+
+/* Counter opened for CPUCYCLES_PERF */
+extern int cpucycles_perf_fd;
+
+/* Ticks taken by timing nothing, from back to back reads of the timer */
+typedef struct {
+    int backend;      /* Timer calibrated, or -1 */
+    int64_t overhead; /* Fewest ticks, taken off every measurement */
+    int64_t median;   /* Typical ticks */
+    int64_t jitter;   /* Median absolute deviation of the ticks */
+} cpucycles_calibration_t;
+
+extern cpucycles_calibration_t cpucycles_calibration;
+
+/* Set up and calibrate the timer in use, unless already done. Return false
+ * if it is not available.
+ */
+bool cpucycles_init(void);
+
+/* Describe the timer in use and its unit */
+const char *cpucycles_name(void);
+const char *cpucycles_unit(void);
 
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
@@ -26,4 +63,76 @@ static inline int64_t cpucycles(void)
 #endif
 }
 
+/* Read the cycle counter once the code before has finished, and before the
+ * code after starts.
+ */
+static inline int64_t cpucycles_fenced(bool after)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    if (after) {
+        __asm__ volatile("rdtscp\n\tlfence\n\t"
+                         : "=a"(lo), "=d"(hi)
+                         :
+                         : "ecx", "memory");
+    } else {
+        __asm__ volatile("lfence\n\trdtsc\n\tlfence\n\t"
+                         : "=a"(lo), "=d"(hi)
+                         :
+                         : "memory");
+    }
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#endif
+}
+
+static inline int64_t cpucycles_perf(void)
+{
+    uint64_t count;
+    if (read(cpucycles_perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+static inline int64_t cpucycles_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read the timer in use just before the code measured */
+static inline int64_t cpucycles_begin(void)
+{
+    switch (cpucycles_backend) {
+    case CPUCYCLES_SERIALIZED:
+        return cpucycles_fenced(false);
+    case CPUCYCLES_PERF:
+        return cpucycles_perf();
+    case CPUCYCLES_CLOCK:
+        return cpucycles_clock();
+    default:
+        return cpucycles();
+    }
+}
+
+/* Read the timer in use just after the code measured */
+static inline int64_t cpucycles_end(void)
+{
+    switch (cpucycles_backend) {
+    case CPUCYCLES_SERIALIZED:
+        return cpucycles_fenced(true);
+    case CPUCYCLES_PERF:
+        return cpucycles_perf();
+    case CPUCYCLES_CLOCK:
+        return cpucycles_clock();
+    default:
+        return cpucycles();
+    }
+}
+
 #endif
@@ -24,6 +24,12 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - in sequential mode, a round may stop before it has enough measurements.
+ *    It passes once, with the configured confidence, the effect size seen by
+ *    every test is too small to take its t statistic past the threshold over
+ *    a full round, and it fails on a statistic past any doubt; otherwise it
+ *    goes on measuring.
  */
 
 #include <assert.h>
@@ -37,6 +43,7 @@
 #include "../random.h"
 
 #include "constant.h"
+#include "cpucycles.h"
 #include "fixture.h"
 #include "ttest.h"
 
@@ -45,9 +52,21 @@
 #define NUMBER_PERCENTILES 100
 #define DUDECT_TESTS (1 + NUMBER_PERCENTILES)
 
+/* Fewest measurements a round passes on in sequential mode */
+#define SEQUENTIAL_MIN_MEASURE (ENOUGH_MEASURE / 4)
+
 // The size of the t_context_t array should be DUDECT_TESTS
 static t_context_t **t;
 
+int sequential_confidence = 0;
+
+/* Outcome of a round so far */
+typedef enum {
+    VERDICT_NONE,     /* Keep measuring */
+    VERDICT_LEAK,     /* Not constant time */
+    VERDICT_CONSTANT, /* Maybe constant time */
+} verdict_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
@@ -59,28 +78,45 @@ static void __attribute__((noreturn)) die(void)
     exit(111);
 }
 
+/* Take the overhead of the timer off every measurement. Those it would leave
+ * with no time still count, as the fastest ones.
+ */
 static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
-    for (size_t i = 0; i < N_MEASURES; i++)
+    for (size_t i = 0; i < N_MEASURES; i++) {
         exec_times[i] = after_ticks[i] - before_ticks[i];
+        if (exec_times[i] > 0) {
+            exec_times[i] -= cpucycles_calibration.overhead;
+            if (exec_times[i] < 1)
+                exec_times[i] = 1;
+        }
+    }
 }
 
 static int cmp(const int64_t *a, const int64_t *b)
 {
-    return (int) (*a - *b);
+    return (*a > *b) - (*a < *b);
 }
 
 static int64_t percentile(int64_t *a_sorted, double which, size_t size)
 {
     size_t array_position = (size_t) ((double) size * (double) which);
     assert(array_position < size);
-    return a_sorted[array_position];
+    return a_sorted[array_position] >> 1;
 }
 
-static void prepare_percentiles(int64_t *exec_times, int64_t *percentiles)
+/* Sort the measurements by execution time, each carrying its class in the
+ * lowest bit, so that the measurements kept by any cropping threshold are a
+ * prefix of the sorted array for both classes at once.
+ */
+static void prepare_percentiles(int64_t *exec_times,
+                                const uint8_t *classes,
+                                int64_t *percentiles)
 {
+    for (size_t i = 0; i < N_MEASURES; i++)
+        exec_times[i] = exec_times[i] * 2 + classes[i];
     qsort(exec_times, N_MEASURES, sizeof(int64_t),
           (int (*)(const void *, const void *)) cmp);
     for (size_t i = 0; i < NUMBER_PERCENTILES; i++) {
@@ -91,28 +127,65 @@ static void prepare_percentiles(int64_t *exec_times, int64_t *percentiles)
     }
 }
 
-
-static void update_statistics(const int64_t *exec_times,
-                              uint8_t *classes,
-                              int64_t *percentiles)
+/* Running sums of a prefix of the sorted measurements, per class. Values
+ * are taken relative to a pivot close to them, which keeps the variance
+ * derived from the sums accurate.
+ */
+typedef struct {
+    double n[2];
+    double sum[2];
+    double sum2[2];
+    double pivot;
+} prefix_t;
+
+static void push_prefix(t_context_t *ctx, const prefix_t *prefix)
 {
-    for (size_t i = 0; i < N_MEASURES; i++) {
-        int64_t difference = exec_times[i];
-        /* CPU cycle counter overflowed or dropped measurement */
-        if (difference <= 0)
+    for (uint8_t class = 0; class < 2; class ++) {
+        double n = prefix->n[class];
+        if (!n)
             continue;
+        double mean = prefix->sum[class] / n;
+        double m2 = prefix->sum2[class] - prefix->sum[class] * mean;
+        t_merge(ctx, n, prefix->pivot + mean, m2 > 0 ? m2 : 0, class);
+    }
+}
 
-        // t-test on the execution time
-        t_push(t[0], difference, classes[i]);
+/* Feed all tests from one pass over the sorted measurements. As thresholds
+ * rise with the cropping index, each cropped test takes the prefix sums
+ * reached when the first measurement at or above its threshold shows up,
+ * and the uncropped test takes the sums of all of them.
+ */
+static void update_statistics(const int64_t *exec_times,
+                              const int64_t *percentiles)
+{
+    size_t i = 0;
+    /* CPU cycle counter overflowed or dropped measurement */
+    while (i < N_MEASURES && exec_times[i] >> 1 <= 0)
+        i++;
+    if (i == N_MEASURES)
+        return;
+
+    prefix_t prefix = {.pivot = exec_times[(i + N_MEASURES) / 2] >> 1};
+    size_t crop_index = 0;
+    for (; i < N_MEASURES; i++) {
+        int64_t difference = exec_times[i] >> 1;
+        uint8_t class = exec_times[i] & 1;
 
         // t-test on cropped execution times, for several cropping thresholds.
-        for (size_t crop_index = 0; crop_index < NUMBER_PERCENTILES;
-             crop_index++) {
-            if (difference < percentiles[crop_index]) {
-                t_push(t[crop_index + 1], difference, classes[i]);
-            }
-        }
+        while (crop_index < NUMBER_PERCENTILES &&
+               difference >= percentiles[crop_index])
+            push_prefix(t[++crop_index], &prefix);
+
+        double x = difference - prefix.pivot;
+        prefix.n[class]++;
+        prefix.sum[class] += x;
+        prefix.sum2[class] += x * x;
     }
+    while (crop_index < NUMBER_PERCENTILES)
+        push_prefix(t[++crop_index], &prefix);
+
+    // t-test on the execution time
+    push_prefix(t[0], &prefix);
 }
 
 static t_context_t *max_test(t_context_t *t[])
@@ -131,7 +204,34 @@ static t_context_t *max_test(t_context_t *t[])
     return t[ret];
 }
 
-static bool report(void)
+/* Decide a round before it has enough measurements. Every test is weighed,
+ * as max_test() only picks among those with enough of them. The round passes
+ * once the largest t statistic, raised by z standard errors, would still
+ * stay below the threshold when scaled up to a full round, and fails once a
+ * t statistic is beyond t_threshold_bananas.
+ */
+static verdict_t sequential_verdict(double z)
+{
+    double n = t[0]->n[0] + t[0]->n[1];
+    double max_t = 0;
+    if (!z)
+        return VERDICT_NONE;
+    for (size_t i = 0; i < DUDECT_TESTS; i++) {
+        if (t[i]->n[0] >= 2 && t[i]->n[1] >= 2)
+            max_t = fmax(max_t, fabs(t_compute(t[i])));
+    }
+
+    /* Cropping keeps about the same share of a full round */
+    double max_tau_bound = (max_t + z) / sqrt(n);
+    if (n >= SEQUENTIAL_MIN_MEASURE &&
+        max_tau_bound * sqrt(ENOUGH_MEASURE) < t_threshold_moderate)
+        return VERDICT_CONSTANT;
+    if (max_t > t_threshold_bananas)
+        return VERDICT_LEAK;
+    return VERDICT_NONE;
+}
+
+static verdict_t report(double z)
 {
     t_context_t *target = max_test(t);
     double max_t = fabs(t_compute(target));
@@ -143,7 +243,7 @@ static bool report(void)
     if (number_traces_max_t < ENOUGH_MEASURE) {
         printf("not enough measurements (%.0f still to go).\n",
                ENOUGH_MEASURE - number_traces_max_t);
-        return false;
+        return sequential_verdict(z);
     }
 
     /* max_t: the t statistic value
@@ -161,17 +261,17 @@ static bool report(void)
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
-        return false;
+        return VERDICT_LEAK;
 
     /* Probably not constant time. */
     if (max_t > t_threshold_moderate)
-        return false;
+        return VERDICT_LEAK;
 
     /* For the moment, maybe constant time. */
-    return true;
+    return VERDICT_CONSTANT;
 }
 
-static bool doit(int mode)
+static verdict_t doit(int mode, double z)
 {
     int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
@@ -187,17 +287,20 @@ static bool doit(int mode)
 
     prepare_inputs(input_data, classes);
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
+    bool ok = measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    prepare_percentiles(exec_times, percentiles);
-    update_statistics(exec_times, classes, percentiles);
-    ret &= report();
+    prepare_percentiles(exec_times, classes, percentiles);
+    update_statistics(exec_times, percentiles);
+    verdict_t ret = report(z);
+    if (!ok)
+        ret = VERDICT_LEAK;
 
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
+    free(percentiles);
 
     return ret;
 }
@@ -209,9 +312,32 @@ static void init_once(void)
         t_init(t[i]);
 }
 
+/* Standard errors a normal variable stays below with the given confidence */
+static double z_score(double confidence)
+{
+    double lo = 0, hi = 40;
+    for (int i = 0; i < 64; i++) {
+        double mid = (lo + hi) / 2;
+        if (erfc(mid / sqrt(2)) / 2 > 1 - confidence)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
 static bool test_const(char *text, int mode)
 {
     bool result = false;
+    bool sequential =
+        sequential_confidence > 0 && sequential_confidence < 100;
+    /* Two-sided, as a leak may push the t statistic either way */
+    double alpha = (1 - sequential_confidence / 100.0) / 2;
+    double z = sequential ? z_score(1 - alpha) : 0;
+    long measurements = 0;
+    int rounds = 0;
+    if (!cpucycles_init())
+        return false;
     t = malloc(sizeof(t_context_t *) * DUDECT_TESTS);
     t[0] = malloc(sizeof(t_context_t) * DUDECT_TESTS);
     for (int i = 1; i < DUDECT_TESTS; i++) {
@@ -221,14 +347,28 @@ static bool test_const(char *text, int mode)
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
         init_once();
+        rounds++;
+        verdict_t verdict = VERDICT_NONE;
         for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
              ++i) {
-            result = doit(mode);
+            verdict = doit(mode, z);
+            measurements += N_MEASURES;
+            if (sequential && verdict != VERDICT_NONE)
+                break;
         }
+        result = verdict == VERDICT_CONSTANT;
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
+    printf("Testing %s: %ld measurements in %d of %d rounds\n", text,
+           measurements, rounds, TEST_TRIES);
+    printf("Timer: %s, overhead %ld %s (median %ld), jitter %ld\n",
+           cpucycles_name(), (long) cpucycles_calibration.overhead,
+           cpucycles_unit(), (long) cpucycles_calibration.median,
+           (long) cpucycles_calibration.jitter);
+    free_dut();
+    free(t[0]);
     free(t);
     return result;
 }
@@ -4,6 +4,11 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Confidence percent at which a round of measurements stops as soon as its
+ * outcome is clear (0: measure every round in full)
+ */
+extern int sequential_confidence;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
@@ -27,6 +27,27 @@ void t_push(t_context_t *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Merge a batch of n samples, given their mean and the sum of their squared
+ * deviations from it, as Chan et al. generalize Welford's method.
+ */
+void t_merge(t_context_t *ctx,
+             double n,
+             double mean,
+             double m2,
+             uint8_t class)
+{
+    assert(class == 0 || class == 1);
+    if (n == 0)
+        return;
+
+    double total = ctx->n[class] + n;
+    double delta = mean - ctx->mean[class];
+    ctx->mean[class] = ctx->mean[class] + delta * n / total;
+    ctx->m2[class] =
+        ctx->m2[class] + m2 + delta * delta * ctx->n[class] * n / total;
+    ctx->n[class] = total;
+}
+
 double t_compute(t_context_t *ctx)
 {
     double var[2] = {0.0, 0.0};
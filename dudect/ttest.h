@@ -10,6 +10,11 @@ typedef struct {
 } t_context_t;
 
 void t_push(t_context_t *ctx, double x, uint8_t class);
+void t_merge(t_context_t *ctx,
+             double n,
+             double mean,
+             double m2,
+             uint8_t class);
 double t_compute(t_context_t *ctx);
 void t_init(t_context_t *ctx);
 
@@ -1,13 +1,18 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -25,39 +30,297 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every allocated slab slot */
+#define MAGICSLAB 0xcafebabe
+
+/* Value when deallocate slab slot */
+#define MAGICSLABFREE 0xbabecafe
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    mem_account_t *owner; /* Account the block is charged to */
+    size_t unused;        /* Keeps payloads 16-byte aligned */
+    size_t magic_header;  /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Checking tier in use. The counting tier puts a bare header in front of
+ * each payload, holding its size for the statistics, and counts the blocks
+ * instead of tracking them.
+ */
+static int tier = HARNESS_TIER;
+static _Atomic size_t counted_blocks = 0;
+
+typedef struct {
+    size_t payload_size;
+    mem_account_t *owner;
+} count_header_t;
+
+/* Thread-safe mode.
+ *
+ * While it is set, any number of threads may allocate and free through the
+ * harness, each with an exception context of its own. Shared structures are
+ * then guarded by locks, which are skipped otherwise, so a single thread
+ * pays nothing for them. The mode must only change while a single thread
+ * uses the harness.
+ */
+static bool thread_safe = false;
+
+static inline void harness_lock(pthread_mutex_t *lock)
+{
+    if (thread_safe)
+        pthread_mutex_lock(lock);
+}
+
+static inline void harness_unlock(pthread_mutex_t *lock)
+{
+    if (thread_safe)
+        pthread_mutex_unlock(lock);
+}
+
+/* Add v to a counter shared by threads, and return the new value */
+static inline size_t counter_add(_Atomic size_t *counter, size_t v)
+{
+    if (thread_safe)
+        return atomic_fetch_add_explicit(counter, v, memory_order_relaxed) + v;
+    size_t n = atomic_load_explicit(counter, memory_order_relaxed) + v;
+    atomic_store_explicit(counter, n, memory_order_relaxed);
+    return n;
+}
+
+/* Set of the payload addresses of all live blocks and slab slots, kept as
+ * open-addressing hash tables with linear probing. Addresses are spread by
+ * Fibonacci hashing, and removal shifts the following entries of the probe
+ * sequence back, so no tombstones build up. Lookups stay O(1) however many
+ * blocks are live, which keeps cautious mode affordable on big queues.
+ *
+ * The addresses are split among LIVE_SHARDS tables, each with a lock of its
+ * own, by the 1 MiB region they lie in. Blocks allocated together, which
+ * tend to be freed together, then mostly share a table, and threads, which
+ * malloc serves from arenas of their own, rarely contend for one. The number
+ * of allocated blocks is the sum of the table sizes.
+ */
+#define LIVE_SHARDS 16 /* Power of two */
+#define LIVE_SHARD_BITS 4
+#define LIVE_REGION_BITS 20
+#define LIVE_MIN_CAPACITY 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    void **blocks;
+    size_t count;
+    size_t capacity; /* Power of two, or 0 before first use */
+    unsigned shift;  /* 64 - log2(capacity) */
+} live_shard_t;
+
+static live_shard_t live_shards[LIVE_SHARDS];
+
+/* Slab allocator for small blocks such as queue elements.
+ *
+ * Every slab is a SLAB_BYTES sized, SLAB_BYTES aligned chunk carved into
+ * fixed-size slots, so the owning slab of a payload is found by masking its
+ * address. A slot starts with the same fields as block_element_t, which
+ * lets test_free() tell slots from regular blocks by the magic number alone,
+ * plus a footer after the payload. Free slots are threaded through their
+ * payload into a per-slab free list.
+ */
+#define SLAB_BYTES (64 * 1024)
+#define SLAB_OBJ_SIZE 64
+
+typedef struct {
+    size_t payload_size;
+    mem_account_t *owner;
+    size_t unused;
+    size_t magic_header; /* MAGICSLAB or MAGICSLABFREE */
+    unsigned char payload[0];
+} slab_slot_t;
+
+/* Slot stride rounded up to keep every payload 16-byte aligned */
+#define SLAB_SLOT_SIZE \
+    ((sizeof(slab_slot_t) + SLAB_OBJ_SIZE + sizeof(size_t) + 15) & ~15UL)
+
+typedef struct __slab {
+    struct __slab *next, *prev;
+    slab_slot_t *free_slots; /* Next free slot is stored in the payload */
+    size_t in_use;
+    unsigned char slots[0] __attribute__((aligned(16)));
+} slab_t;
+
+#define SLAB_NSLOTS ((SLAB_BYTES - sizeof(slab_t)) / SLAB_SLOT_SIZE)
+
+static slab_t *partial_slabs = NULL; /* Slabs with at least one free slot */
+static slab_t *full_slabs = NULL;
+
+/* Serve allocations of at most SLAB_OBJ_SIZE bytes from slabs */
+int slab_mode = 0;
+
+/* Guard page arena.
+ *
+ * Each block gets a unit of two pages: a data page holding the payload at
+ * its very end, and an inaccessible guard page right behind it, so writing
+ * past the payload faults at once instead of being noticed at free time.
+ * Payloads are rounded up to GUARD_ALIGN bytes; the slack is filled and
+ * checked at free like a footer. A data page is made accessible the first
+ * time its unit is handed out and stays so, hence reusing a released unit
+ * costs no system call, and payloads are not filled.
+ *
+ * Sizes and liveness are kept in a side table rather than in front of the
+ * payload. The kernel tracks every protected page as a mapping of its own,
+ * so the arena is capped at GUARD_UNITS blocks; further allocations fall
+ * back to regular blocks.
+ */
+#define GUARD_UNITS 16384
+#define GUARD_ALIGN 16
+
+typedef struct {
+    size_t payload_size;
+    mem_account_t *owner;
+    bool live;
+} guard_unit_t;
+
+static unsigned char *guard_arena = NULL;
+static size_t guard_page_size = 0;
+static guard_unit_t *guard_units = NULL;
+static size_t *guard_free_units = NULL; /* Stack of released units */
+static size_t guard_nfree = 0, guard_used = 0;
+static bool guard_failed = false;
+
+/* Place small allocations against guard pages */
+int guard_mode = 0;
+
+/* Huge page arena.
+ *
+ * Blocks are bump-allocated, headers and footers included, from chunks of
+ * ARENA_CHUNK_BYTES carved out of one aligned address range, so the nodes
+ * and strings of a big queue share a few huge pages rather than thousands
+ * of small ones scattered over the heap. A chunk is mapped from the
+ * hugetlbfs pool when it has pages to spare, and otherwise from regular
+ * memory marked for transparent huge pages.
+ *
+ * Freeing a block only drops the live count of its chunk; the space is
+ * reclaimed in bulk once the whole chunk is free, as happens when a queue
+ * is freed. The current chunk is then reused in place, and others are kept
+ * for reuse, up to ARENA_KEEP of them, or given back to the system.
+ */
+#define ARENA_CHUNK_BITS 21
+#define ARENA_CHUNK_BYTES ((size_t) 1 << ARENA_CHUNK_BITS)
+#define ARENA_CHUNKS 8192 /* 16 GiB of address space */
+#define ARENA_MAX_BLOCK (ARENA_CHUNK_BYTES / 8)
+#define ARENA_KEEP 4
+
+enum { ARENA_UNMAPPED, ARENA_HUGETLB, ARENA_PAGES };
 
-/* Percent probability of malloc failure */
+typedef struct {
+    uint32_t live; /* Blocks allocated and not yet freed */
+    uint8_t backing;
+} arena_chunk_t;
+
+static unsigned char *arena_base = NULL;
+static arena_chunk_t *arena_chunks = NULL;
+static uint32_t *arena_idle = NULL; /* Stack of free chunks */
+static size_t arena_nidle = 0, arena_used = 0;
+static size_t arena_current = 0, arena_top = ARENA_CHUNK_BYTES;
+static size_t arena_mapped = 0, arena_hugetlb = 0, arena_bulk_frees = 0;
+static bool arena_failed = false, arena_no_hugetlb = false;
+
+/* Serve allocations from the huge page arena when nonzero */
+int arena_mode = 0;
+
+/* Fault injection schedules, restarted by fault_command() for every command:
+ * fail with a percent probability, fail every fail_every-th allocation, or
+ * fail every allocation past the first fail_after ones. Probabilities are
+ * drawn from a splitmix64 stream seeded by fail_seed and the number of
+ * commands since the parameters last changed, so a failure pattern is
+ * replayed by running the same commands with the seed that was logged when
+ * injection got armed.
+ */
 int fail_probability = 0;
+int fail_every = 0;
+int fail_after = 0;
+int fail_seed = 0;
+
+static bool fault_armed = false; /* Whether any schedule is active */
+static uint64_t fault_threshold; /* Draws below it fail */
+static uint64_t fault_state;
+static size_t fault_commands = 0, fault_allocs = 0;
 
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Time budget of the running command in nanoseconds, 0 for none, and how
+ * much of it the risky code of the command has used so far
+ */
+static int64_t time_budget = 0, budget_used = 0;
+
+/* Per-thread state: the exception context, and in thread-safe mode a cache
+ * of free slab slots, which spares most allocations and frees the slab lock.
+ * The first thread to use the harness gets main_thread; the state of others
+ * is created on demand and released when they exit.
+ */
+#define SLAB_CACHE 32
+
+typedef struct {
+    /* Data for managing exceptions */
+    sigjmp_buf env;
+    volatile sig_atomic_t jmp_ready;
+    volatile sig_atomic_t busy;  /* Allocating or freeing */
+    volatile sig_atomic_t holds; /* Nesting of exception_hold() */
+    char *volatile deferred;     /* Exception raised meanwhile */
+    bool time_limited;
+    bool clocking;                  /* Timing allocations and frees */
+    int64_t clock_start, clock_sum; /* In nanoseconds */
+    void **held_frees;              /* Blocks freed while clocking */
+    size_t held, held_capacity;
+    char *error_message;
+
+    slab_slot_t *slab_cache[SLAB_CACHE];
+    size_t slab_cached;
+} harness_thread_t;
+
+static harness_thread_t main_thread = {.error_message = ""};
+static bool main_bound = false;
+static __thread harness_thread_t *self = NULL;
+static pthread_key_t thread_key; /* Releases the state of other threads */
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t slab_lock, guard_lock, arena_lock, fault_lock;
+
+/* Time limit watchdog.
+ *
+ * Arming and disarming the time limit only store a deadline, so a command
+ * costs no system call for it. A watchdog thread sleeps until the deadline
+ * and then sends SIGALRM to the thread running the command. While idle it
+ * wakes up every time_limit seconds, which is never later than any deadline
+ * armed meanwhile; it is only woken early when the limit changes.
+ */
+#if defined(__APPLE__)
+#define WATCHDOG_CLOCK CLOCK_REALTIME /* No pthread_condattr_setclock() */
+#else
+#define WATCHDOG_CLOCK CLOCK_MONOTONIC
+#endif
+
+#define DEADLINE_NONE 0
+#define DEADLINE_FIRED (-1) /* SIGALRM sent for the armed deadline */
+#define REFIRE_DELAY 1000000 /* Nanoseconds */
+
+static _Atomic int64_t deadline = DEADLINE_NONE; /* Nanoseconds */
+static int64_t armed_at;
+static bool budget_due; /* The deadline armed is the time budget's */
+static _Atomic int64_t watchdog_wake = INT64_MAX;
+static pthread_t watchdog_target;
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;
+static bool watchdog_running = false;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -67,41 +330,308 @@ typedef enum {
 
 /* Internal functions */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+static inline uint64_t fault_next()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    fault_state += 0x9e3779b97f4a7c15ULL;
+    return random_shuffle(fault_state);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Should this allocation fail? Only called when a schedule is armed.
+ * Return the number of the allocation within its command if so, else 0.
  */
-static block_element_t *find_header(void *p)
+static size_t fail_allocation()
 {
-    if (!p) {
-        report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+    harness_lock(&fault_lock);
+    size_t n = ++fault_allocs;
+    bool fail = (fail_every > 0 && n % fail_every == 0) ||
+                (fail_after > 0 && n > (size_t) fail_after) ||
+                fail_probability >= 100 ||
+                (fault_threshold && fault_next() < fault_threshold);
+    harness_unlock(&fault_lock);
+    return fail ? n : 0;
+}
+
+/* State of the calling thread */
+static harness_thread_t *this_thread()
+{
+    if (self)
+        return self;
+    if (!main_bound) {
+        main_bound = true;
+        return self = &main_thread;
     }
 
-    block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
+    harness_thread_t *t = calloc(1, sizeof(*t));
+    if (!t)
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    t->error_message = "";
+    pthread_setspecific(thread_key, t);
+    return self = t;
+}
+
+/* An allocation or free is never cut short by a signal: jumping out of it
+ * could leave a lock of malloc or of the harness held, or a block half
+ * recorded. A time limit expiring meanwhile is raised on entry to the next
+ * one instead, by when the caller has stored the block it got, or by the
+ * watchdog firing again if the code no longer allocates.
+ */
+static void refire_time_limit();
+
+static int64_t clock_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline harness_thread_t *harness_enter()
+{
+    harness_thread_t *t = this_thread();
+    if (t->deferred && !t->holds)
+        trigger_exception(t->deferred);
+    t->busy = true;
+    if (t->clocking)
+        t->clock_start = clock_now();
+    return t;
+}
+
+static inline void harness_leave(harness_thread_t *t)
+{
+    if (t->clocking)
+        t->clock_sum += clock_now() - t->clock_start;
+    t->busy = false;
+    if (t->deferred && !t->holds)
+        refire_time_limit();
+}
+
+static inline uint64_t live_hash(const void *p)
+{
+    return (uint64_t) (uintptr_t) p * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline live_shard_t *live_shard(const void *p)
+{
+    uintptr_t region = (uintptr_t) p >> LIVE_REGION_BITS;
+    return &live_shards[live_hash((void *) region) >> (64 - LIVE_SHARD_BITS)];
+}
+
+static inline size_t live_slot(const live_shard_t *shard, const void *p)
+{
+    return live_hash(p) >> shard->shift;
+}
+
+/* Double a live block table, or create it */
+static void live_grow(live_shard_t *shard)
+{
+    size_t old_capacity = shard->capacity;
+    void **old = shard->blocks;
+
+    shard->capacity = old_capacity ? 2 * old_capacity : LIVE_MIN_CAPACITY;
+    shard->shift = 64 - __builtin_ctzll(shard->capacity);
+    shard->blocks = calloc(shard->capacity, sizeof(void *));
+    if (!shard->blocks)
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i])
+            continue;
+        size_t j = live_slot(shard, old[i]);
+        while (shard->blocks[j])
+            j = (j + 1) & (shard->capacity - 1);
+        shard->blocks[j] = old[i];
+    }
+    free(old);
+}
+
+/* Record p as live */
+static void live_insert(void *p)
+{
+    live_shard_t *shard = live_shard(p);
+    harness_lock(&shard->lock);
+
+    /* Keep the load factor at most 3/4 */
+    if (4 * (shard->count + 1) > 3 * shard->capacity)
+        live_grow(shard);
+
+    size_t i = live_slot(shard, p);
+    while (shard->blocks[i])
+        i = (i + 1) & (shard->capacity - 1);
+    shard->blocks[i] = p;
+    shard->count++;
+
+    harness_unlock(&shard->lock);
+}
+
+/* Forget p, returning whether it was live */
+static bool live_remove(void *p)
+{
+    live_shard_t *shard = live_shard(p);
+    harness_lock(&shard->lock);
+    if (!shard->capacity) {
+        harness_unlock(&shard->lock);
+        return false;
+    }
+
+    void **blocks = shard->blocks;
+    size_t mask = shard->capacity - 1, i = live_slot(shard, p);
+    while (blocks[i] != p) {
+        if (!blocks[i]) {
+            harness_unlock(&shard->lock);
+            return false;
         }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
+        i = (i + 1) & mask;
+    }
+
+    /* Move back every later entry of the cluster which may not stay behind
+     * the hole, so each entry remains reachable from its home slot.
+     */
+    for (size_t j = (i + 1) & mask; blocks[j]; j = (j + 1) & mask) {
+        size_t home = live_slot(shard, blocks[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            blocks[i] = blocks[j];
+            i = j;
         }
     }
+    blocks[i] = NULL;
+    shard->count--;
+
+    harness_unlock(&shard->lock);
+    return true;
+}
+
+/* Allocation statistics.
+ *
+ * Allocations are binned into power-of-two size classes: class 0 holds
+ * empty requests and class i > 0 those of [2^(i-1), 2^i) bytes, the last
+ * class being open-ended. Counts are also kept per console command, and,
+ * when memstat_sites is set, per calling address.
+ */
+#define MEMSTAT_CLASSES 16
+#define MEMSTAT_COMMANDS 64
+#define MEMSTAT_SITES 256 /* Power of two */
+
+typedef struct {
+    const char *name;
+    _Atomic size_t allocs, alloc_bytes, frees, free_bytes;
+} memstat_command_t;
+
+typedef struct {
+    void *site;
+    size_t allocs, bytes;
+} memstat_site_t;
+
+/* Counters are updated with counter_add(), and sites under a lock, so that
+ * threads can share them.
+ */
+static struct {
+    _Atomic size_t allocs, frees, live_bytes, peak_bytes;
+    _Atomic size_t classes[MEMSTAT_CLASSES];
+    memstat_command_t commands[MEMSTAT_COMMANDS];
+    size_t ncommands;
+    memstat_command_t *command; /* The one running, if tracked */
+    memstat_site_t sites[MEMSTAT_SITES];
+    size_t sites_dropped; /* Allocations whose site found no room */
+    pthread_mutex_t sites_lock;
+} memstat;
 
+/* Record the calling address of every allocation */
+int memstat_sites = 0;
+
+/* Account of the queue that allocations are charged to, besides the total
+ * kept by report.c. Each block keeps the account it was charged to, which
+ * its free is released against.
+ */
+static mem_account_t *mem_owner = NULL;
+
+/* Start of the executable image, provided by the linker */
+extern const char __executable_start;
+
+static inline int memstat_class(size_t size)
+{
+    int c = size ? 64 - __builtin_clzll(size) : 0;
+    return c < MEMSTAT_CLASSES ? c : MEMSTAT_CLASSES - 1;
+}
+
+static void memstat_site(void *site, size_t size)
+{
+    size_t mask = MEMSTAT_SITES - 1;
+    size_t i = ((uintptr_t) site * 0x9e3779b97f4a7c15ULL) >> 56 & mask;
+    harness_lock(&memstat.sites_lock);
+    for (size_t probes = 0; probes < MEMSTAT_SITES; probes++) {
+        memstat_site_t *entry = &memstat.sites[(i + probes) & mask];
+        if (!entry->site)
+            entry->site = site;
+        if (entry->site == site) {
+            entry->allocs++;
+            entry->bytes += size;
+            harness_unlock(&memstat.sites_lock);
+            return;
+        }
+    }
+    memstat.sites_dropped++;
+    harness_unlock(&memstat.sites_lock);
+}
+
+/* Raise the peak of live bytes to live if below */
+static void memstat_peak(size_t live)
+{
+    size_t peak = atomic_load_explicit(&memstat.peak_bytes,
+                                       memory_order_relaxed);
+    while (live > peak) {
+        if (!thread_safe) {
+            atomic_store_explicit(&memstat.peak_bytes, live,
+                                  memory_order_relaxed);
+            return;
+        }
+        if (atomic_compare_exchange_weak_explicit(&memstat.peak_bytes, &peak,
+                                                  live, memory_order_relaxed,
+                                                  memory_order_relaxed))
+            return;
+    }
+}
+
+/* Count an allocation of size bytes from site */
+static void memstat_alloc(size_t size, void *site)
+{
+    counter_add(&memstat.allocs, 1);
+    counter_add(&memstat.classes[memstat_class(size)], 1);
+    memstat_peak(counter_add(&memstat.live_bytes, size));
+    memstat_command_t *command = memstat.command;
+    if (command) {
+        counter_add(&command->allocs, 1);
+        counter_add(&command->alloc_bytes, size);
+    }
+    if (memstat_sites)
+        memstat_site(site, size);
+}
+
+/* Record p of size bytes, allocated from site, as live */
+static void track_alloc(void *p, size_t size, void *site)
+{
+    live_insert(p);
+    memstat_alloc(size, site);
+}
+
+/* Account for the release of a block of size bytes charged to owner */
+static void track_free(mem_account_t *owner, size_t size)
+{
+    mem_release(owner, size);
+    counter_add(&memstat.frees, 1);
+    counter_add(&memstat.live_bytes, -size);
+    memstat_command_t *command = memstat.command;
+    if (command) {
+        counter_add(&command->frees, 1);
+        counter_add(&command->free_bytes, size);
+    }
+}
+
+/* Find header of block, given its payload.
+ * Signal error if doesn't seem like legitimate block
+ */
+static block_element_t *find_header(void *p)
+{
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (b->magic_header != MAGICHEADER) {
         report_event(
             MSG_ERROR,
@@ -122,8 +652,473 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Magic number just in front of a payload, shared by blocks and slab slots */
+static inline size_t payload_magic(const void *p)
+{
+    return ((const size_t *) p)[-1];
+}
+
+static inline slab_t *slab_of(const void *p)
+{
+    return (slab_t *) ((uintptr_t) p & ~((uintptr_t) SLAB_BYTES - 1));
+}
+
+static inline slab_slot_t *slot_of(void *p)
+{
+    return (slab_slot_t *) ((size_t) p - sizeof(slab_slot_t));
+}
+
+static inline size_t *slot_footer(slab_slot_t *slot)
+{
+    return (size_t *) &slot->payload[slot->payload_size];
+}
+
+static void slab_push(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_unlink(slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static slab_t *slab_new()
+{
+    slab_t *slab = NULL;
+    if (posix_memalign((void **) &slab, SLAB_BYTES, SLAB_BYTES))
+        return NULL;
+
+    slab->in_use = 0;
+    slab->free_slots = NULL;
+    for (size_t i = SLAB_NSLOTS; i > 0; i--) {
+        slab_slot_t *slot =
+            (slab_slot_t *) &slab->slots[(i - 1) * SLAB_SLOT_SIZE];
+        slot->magic_header = MAGICSLABFREE;
+        *(slab_slot_t **) slot->payload = slab->free_slots;
+        slab->free_slots = slot;
+    }
+    slab_push(&partial_slabs, slab);
+    return slab;
+}
+
+static slab_slot_t *slab_alloc()
+{
+    slab_t *slab = partial_slabs ? partial_slabs : slab_new();
+    if (!slab)
+        return NULL;
+
+    slab_slot_t *slot = slab->free_slots;
+    slab->free_slots = *(slab_slot_t **) slot->payload;
+    slab->in_use++;
+
+    if (!slab->free_slots) {
+        slab_unlink(&partial_slabs, slab);
+        slab_push(&full_slabs, slab);
+    }
+    return slot;
+}
+
+static void slab_free(slab_slot_t *slot)
 {
+    slab_t *slab = slab_of(slot);
+
+    if (!slab->free_slots) {
+        slab_unlink(&full_slabs, slab);
+        slab_push(&partial_slabs, slab);
+    }
+    *(slab_slot_t **) slot->payload = slab->free_slots;
+    slab->free_slots = slot;
+    slab->in_use--;
+
+    /* Release drained slabs, but keep one around to absorb churn */
+    if (!slab->in_use && (slab->prev || slab->next)) {
+        slab_unlink(&partial_slabs, slab);
+        free(slab);
+    }
+}
+
+/* Return the slots cached by thread t to their slabs, but for keep of them */
+static void slab_flush(harness_thread_t *t, size_t keep)
+{
+    harness_lock(&slab_lock);
+    while (t->slab_cached > keep)
+        slab_free(t->slab_cache[--t->slab_cached]);
+    harness_unlock(&slab_lock);
+}
+
+/* Take a free slot, in thread-safe mode from the cache of the calling
+ * thread, which is refilled by half at a time.
+ */
+static slab_slot_t *slab_get()
+{
+    if (!thread_safe)
+        return slab_alloc();
+
+    harness_thread_t *t = this_thread();
+    if (!t->slab_cached) {
+        pthread_mutex_lock(&slab_lock);
+        while (t->slab_cached < SLAB_CACHE / 2) {
+            slab_slot_t *slot = slab_alloc();
+            if (!slot)
+                break;
+            t->slab_cache[t->slab_cached++] = slot;
+        }
+        pthread_mutex_unlock(&slab_lock);
+        if (!t->slab_cached)
+            return NULL;
+    }
+    return t->slab_cache[--t->slab_cached];
+}
+
+/* Give back a slot, in thread-safe mode to the cache of the calling thread,
+ * which is flushed by half when full.
+ */
+static void slab_put(slab_slot_t *slot)
+{
+    if (!thread_safe) {
+        slab_free(slot);
+        return;
+    }
+
+    harness_thread_t *t = this_thread();
+    if (t->slab_cached == SLAB_CACHE)
+        slab_flush(t, SLAB_CACHE / 2);
+    t->slab_cache[t->slab_cached++] = slot;
+}
+
+/* Counterpart of find_header() and the footer check for slab slots */
+static void slab_free_checked(void *p)
+{
+    slab_slot_t *slot = slot_of(p);
+    if (*slot_footer(slot) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+    slot->magic_header = MAGICSLABFREE;
+    *slot_footer(slot) = MAGICFREE;
+    memset(p, FILLCHAR, slot->payload_size);
+
+    size_t size = slot->payload_size;
+    mem_account_t *owner = slot->owner;
+    slab_put(slot);
+    track_free(owner, size);
+}
+
+static bool guard_init()
+{
+    guard_page_size = sysconf(_SC_PAGESIZE);
+    guard_arena =
+        mmap(NULL, 2 * guard_page_size * GUARD_UNITS, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    guard_units = calloc(GUARD_UNITS, sizeof(*guard_units));
+    guard_free_units = malloc(GUARD_UNITS * sizeof(*guard_free_units));
+    if (guard_arena != MAP_FAILED && guard_units && guard_free_units)
+        return true;
+
+    report_event(MSG_WARN, "Guard page arena unavailable");
+    if (guard_arena != MAP_FAILED)
+        munmap(guard_arena, 2 * guard_page_size * GUARD_UNITS);
+    guard_arena = NULL;
+    free(guard_units);
+    free(guard_free_units);
+    guard_failed = true;
+    return false;
+}
+
+static inline bool guard_owns(const void *p)
+{
+    return guard_arena && (const unsigned char *) p >= guard_arena &&
+           (const unsigned char *) p <
+               guard_arena + 2 * guard_page_size * GUARD_UNITS;
+}
+
+/* End of the data page of a unit, where the guard page starts */
+static inline unsigned char *guard_data_end(size_t unit)
+{
+    return guard_arena + (2 * unit + 1) * guard_page_size;
+}
+
+static inline size_t guard_span(size_t size)
+{
+    return (size + GUARD_ALIGN - 1) & ~((size_t) GUARD_ALIGN - 1);
+}
+
+/* Return a payload of size bytes ending at a guard page, or NULL when the
+ * arena cannot take it.
+ */
+static void *guard_alloc(size_t size)
+{
+    if (!guard_arena && (guard_failed || !guard_init()))
+        return NULL;
+    size_t span = guard_span(size);
+    if (span > guard_page_size)
+        return NULL;
+
+    size_t unit;
+    if (guard_nfree) {
+        unit = guard_free_units[--guard_nfree];
+    } else if (guard_used < GUARD_UNITS &&
+               !mprotect(guard_data_end(guard_used) - guard_page_size,
+                         guard_page_size, PROT_READ | PROT_WRITE)) {
+        unit = guard_used++;
+    } else {
+        return NULL;
+    }
+
+    unsigned char *end = guard_data_end(unit);
+    guard_units[unit].payload_size = size;
+    guard_units[unit].owner = mem_owner;
+    guard_units[unit].live = true;
+    memset(end - span + size, FILLCHAR, span - size);
+    return end - span;
+}
+
+static void guard_free(void *p)
+{
+    size_t unit = ((unsigned char *) p - guard_arena) / (2 * guard_page_size);
+    guard_unit_t *g = &guard_units[unit];
+    unsigned char *end = guard_data_end(unit);
+    size_t span = guard_span(g->payload_size);
+    if (!g->live || (unsigned char *) p != end - span) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to free unallocated or corrupted block.  Address = %p",
+            p);
+        error_occurred = true;
+        return;
+    }
+
+    for (unsigned char *c = end - span + g->payload_size; c < end; c++) {
+        if (*c != FILLCHAR) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+            break;
+        }
+    }
+    g->live = false;
+    guard_free_units[guard_nfree++] = unit;
+    track_free(g->owner, g->payload_size);
+}
+
+/* Reserve the address range of the arena, aligned to a chunk */
+static bool arena_init()
+{
+    size_t span = (size_t) ARENA_CHUNKS << ARENA_CHUNK_BITS;
+    unsigned char *range =
+        mmap(NULL, span + ARENA_CHUNK_BYTES, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    arena_chunks = calloc(ARENA_CHUNKS, sizeof(*arena_chunks));
+    arena_idle = malloc(ARENA_CHUNKS * sizeof(*arena_idle));
+    if (range != MAP_FAILED && arena_chunks && arena_idle) {
+        size_t lead = -(uintptr_t) range & (ARENA_CHUNK_BYTES - 1);
+        if (lead)
+            munmap(range, lead);
+        munmap(range + lead + span, ARENA_CHUNK_BYTES - lead);
+        arena_base = range + lead;
+        return true;
+    }
+
+    report_event(MSG_WARN, "Huge page arena unavailable");
+    if (range != MAP_FAILED)
+        munmap(range, span + ARENA_CHUNK_BYTES);
+    free(arena_chunks);
+    free(arena_idle);
+    arena_failed = true;
+    return false;
+}
+
+static inline bool arena_owns(const void *p)
+{
+    return arena_base && (const unsigned char *) p >= arena_base &&
+           (const unsigned char *) p <
+               arena_base + ((size_t) ARENA_CHUNKS << ARENA_CHUNK_BITS);
+}
+
+static inline unsigned char *arena_chunk_start(size_t chunk)
+{
+    return arena_base + (chunk << ARENA_CHUNK_BITS);
+}
+
+/* Back a chunk with memory, from the hugetlbfs pool while it lasts */
+static bool arena_map(size_t chunk)
+{
+    unsigned char *start = arena_chunk_start(chunk);
+#ifdef MAP_HUGETLB
+    if (!arena_no_hugetlb) {
+        if (mmap(start, ARENA_CHUNK_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1,
+                 0) != MAP_FAILED) {
+            arena_chunks[chunk].backing = ARENA_HUGETLB;
+            arena_hugetlb++;
+            arena_mapped++;
+            return true;
+        }
+        arena_no_hugetlb = true;
+    }
+#endif
+    /* MAP_FIXED, as a failed huge page mapping may have left a hole */
+    if (mmap(start, ARENA_CHUNK_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1,
+             0) == MAP_FAILED)
+        return false;
+#ifdef MADV_HUGEPAGE
+    madvise(start, ARENA_CHUNK_BYTES, MADV_HUGEPAGE);
+#endif
+    arena_chunks[chunk].backing = ARENA_PAGES;
+    arena_mapped++;
+    return true;
+}
+
+/* Give the memory of a chunk back, keeping its addresses reserved */
+static void arena_unmap(size_t chunk)
+{
+    if (mmap(arena_chunk_start(chunk), ARENA_CHUNK_BYTES, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1,
+             0) == MAP_FAILED)
+        return;
+    if (arena_chunks[chunk].backing == ARENA_HUGETLB)
+        arena_hugetlb--;
+    arena_chunks[chunk].backing = ARENA_UNMAPPED;
+    arena_mapped--;
+}
+
+/* Return a block with room for a payload of size bytes, or NULL when the
+ * arena cannot take it.
+ */
+static block_element_t *arena_alloc(size_t size)
+{
+    if (!arena_base && (arena_failed || !arena_init()))
+        return NULL;
+    size_t span =
+        (sizeof(block_element_t) + size + sizeof(size_t) + 15) & ~15UL;
+    if (span > ARENA_MAX_BLOCK)
+        return NULL;
+
+    if (arena_top + span > ARENA_CHUNK_BYTES) {
+        size_t chunk;
+        if (arena_nidle) {
+            chunk = arena_idle[arena_nidle - 1];
+        } else if (arena_used < ARENA_CHUNKS) {
+            chunk = arena_used;
+        } else {
+            return NULL;
+        }
+        if (arena_chunks[chunk].backing == ARENA_UNMAPPED && !arena_map(chunk))
+            return NULL;
+        if (chunk == arena_used)
+            arena_used++;
+        else
+            arena_nidle--;
+        arena_current = chunk;
+        arena_top = 0;
+    }
+
+    block_element_t *b =
+        (block_element_t *) (arena_chunk_start(arena_current) + arena_top);
+    arena_top += span;
+    arena_chunks[arena_current].live++;
+    return b;
+}
+
+static void arena_free(block_element_t *b)
+{
+    size_t chunk = ((unsigned char *) b - arena_base) >> ARENA_CHUNK_BITS;
+    if (--arena_chunks[chunk].live)
+        return;
+
+    arena_bulk_frees++;
+    if (chunk == arena_current) {
+        arena_top = 0;
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < arena_nidle && kept < ARENA_KEEP; i++)
+        kept += arena_chunks[arena_idle[i]].backing != ARENA_UNMAPPED;
+    if (kept == ARENA_KEEP)
+        arena_unmap(chunk);
+    arena_idle[arena_nidle++] = chunk;
+}
+
+/* Print the arena statistics: the chunks mapped, those from the hugetlbfs
+ * pool, and, as the kernel reports them, how much of the arena is resident
+ * and how much of that is backed by huge pages. Each huge page takes a
+ * single TLB entry, where regular pages take one per page. Hugetlbfs pages
+ * are not part of Rss, transparent huge pages are.
+ */
+static void arena_report()
+{
+    size_t rss = 0, thp = 0, hugetlb = 0;
+#ifdef __linux__
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps) {
+        char line[256];
+        bool inside = false;
+        while (fgets(line, sizeof(line), smaps)) {
+            unsigned long start, end, kb;
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+                inside = arena_owns((void *) start);
+            else if (!inside)
+                continue;
+            else if (sscanf(line, "Rss: %lu kB", &kb) == 1)
+                rss += kb << 10;
+            else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+                thp += kb << 10;
+            else if (sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)
+                hugetlb += kb << 10;
+        }
+        fclose(smaps);
+    }
+#endif
+    long page_size = sysconf(_SC_PAGESIZE);
+    report(1,
+           "arena chunks=%zu hugetlb_chunks=%zu idle_chunks=%zu "
+           "bulk_frees=%zu rss_bytes=%zu huge_bytes=%zu huge_pages=%zu "
+           "small_pages=%zu",
+           arena_mapped, arena_hugetlb, arena_nidle, arena_bulk_frees,
+           rss + hugetlb, thp + hugetlb, (thp + hugetlb) / ARENA_CHUNK_BYTES,
+           (rss - thp) / page_size);
+}
+
+/* Allocation in the counting tier */
+static void *count_alloc(alloc_t alloc_type, size_t size, void *site)
+{
+    count_header_t *h = alloc_type == TEST_CALLOC
+                            ? calloc(1, sizeof(count_header_t) + size)
+                            : malloc(sizeof(count_header_t) + size);
+    if (!h) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+
+    h->payload_size = size;
+    h->owner = mem_owner;
+    counter_add(&counted_blocks, 1);
+    memstat_alloc(size, site);
+    return h + 1;
+}
+
+static void *alloc(alloc_t alloc_type, size_t size, void *site)
+{
+    if (tier == HARNESS_PASSTHROUGH)
+        return alloc_type == TEST_CALLOC ? calloc(1, size) : malloc(size);
+
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
             "Calls to malloc are disallowed",
@@ -133,38 +1128,79 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    size_t failing;
+    if (fault_armed && (failing = fail_allocation())) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
         };
-        report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
+        report_event(MSG_WARN, "%s (command %zu, allocation %zu)",
+                     msg_alloc_failure[alloc_type], fault_commands, failing);
+        return NULL;
+    }
+
+    if (!mem_charge(mem_owner, size)) {
+        report_event(MSG_WARN, "Memory limit exceeded, allocation of %zu bytes",
+                     size);
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    if (tier == HARNESS_COUNTING)
+        return count_alloc(alloc_type, size, site);
+
+    /* Guarded payloads are not filled */
+    if (guard_mode) {
+        harness_lock(&guard_lock);
+        void *p = guard_alloc(size);
+        harness_unlock(&guard_lock);
+        if (p) {
+            if (alloc_type == TEST_CALLOC)
+                memset(p, 0, size);
+            track_alloc(p, size, site);
+            return p;
+        }
+    }
+
+    block_element_t *new_block = NULL;
+    if (arena_mode) {
+        harness_lock(&arena_lock);
+        new_block = arena_alloc(size);
+        harness_unlock(&arena_lock);
+    }
+
+    if (!new_block && slab_mode && size <= SLAB_OBJ_SIZE) {
+        slab_slot_t *slot = slab_get();
+        if (!slot) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+
+        slot->magic_header = MAGICSLAB;
+        slot->payload_size = size;
+        slot->owner = mem_owner;
+        *slot_footer(slot) = MAGICFOOTER;
+        memset(slot->payload, !alloc_type * FILLCHAR, size);
+        track_alloc(slot->payload, size, site);
+
+        return slot->payload;
+    }
+
+    if (!new_block)
+        new_block = malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    new_block->owner = mem_owner;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    track_alloc(p, size, site);
 
     return p;
 }
@@ -173,7 +1209,10 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    harness_thread_t *t = harness_enter();
+    void *p = alloc(TEST_MALLOC, size, __builtin_return_address(0));
+    harness_leave(t);
+    return p;
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,11 +1223,19 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    harness_thread_t *t = harness_enter();
+    void *p = alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
+    harness_leave(t);
+    return p;
 }
 
-void test_free(void *p)
+static void release(void *p)
 {
+    if (tier == HARNESS_PASSTHROUGH) {
+        free(p);
+        return;
+    }
+
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
         return;
@@ -197,6 +1244,43 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (tier == HARNESS_COUNTING) {
+        count_header_t *h = (count_header_t *) p - 1;
+        counter_add(&counted_blocks, -1);
+        track_free(h->owner, h->payload_size);
+        free(h);
+        return;
+    }
+
+    /* Make sure this is really an allocated block before touching it */
+    if (!live_remove(p) && cautious_mode) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+
+    if (guard_owns(p)) {
+        harness_lock(&guard_lock);
+        guard_free(p);
+        harness_unlock(&guard_lock);
+        return;
+    }
+
+    size_t magic = payload_magic(p);
+    if (magic == MAGICSLAB) {
+        slab_free_checked(p);
+        return;
+    }
+    if (magic == MAGICSLABFREE) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to free unallocated or corrupted block.  Address = %p",
+            p);
+        error_occurred = true;
+        return;
+    }
+
     block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -210,38 +1294,222 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
+    track_free(b->owner, b->payload_size);
+    if (arena_owns(b)) {
+        harness_lock(&arena_lock);
+        arena_free(b);
+        harness_unlock(&arena_lock);
+        return;
+    }
     free(b);
-    allocated_count--;
+}
+
+/* Put off the release of p until the clock stops, so that looking up and
+ * scrubbing the block does not disturb the code being timed
+ */
+static void hold_free(harness_thread_t *t, void *p)
+{
+    if (t->held == t->held_capacity) {
+        size_t capacity = t->held_capacity ? 2 * t->held_capacity : 1024;
+        void **frees = realloc(t->held_frees, capacity * sizeof(void *));
+        if (!frees) {
+            release(p);
+            return;
+        }
+        t->held_frees = frees;
+        t->held_capacity = capacity;
+    }
+    t->held_frees[t->held++] = p;
+}
+
+void test_free(void *p)
+{
+    /* Holding a free is as cheap as reading the clock to leave it out */
+    harness_thread_t *t = this_thread();
+    if (t->clocking && t->held < t->held_capacity) {
+        t->held_frees[t->held++] = p;
+        return;
+    }
+
+    t = harness_enter();
+    if (t->clocking)
+        hold_free(t, p);
+    else
+        release(p);
+    harness_leave(t);
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    harness_thread_t *t = harness_enter();
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
+    harness_leave(t);
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+void harness_clock_start()
+{
+    harness_thread_t *t = this_thread();
+    t->clocking = true;
+    t->clock_sum = 0;
+}
+
+double harness_clock_stop()
+{
+    harness_thread_t *t = this_thread();
+    t->clocking = false;
+    for (size_t i = 0; i < t->held; i++)
+        release(t->held_frees[i]);
+    t->held = 0;
+    return t->clock_sum;
+}
+
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = counted_blocks;
+    for (int i = 0; i < LIVE_SHARDS; i++)
+        count += live_shards[i].count;
+    return count;
+}
+
+bool set_harness_tier(int new_tier)
+{
+    if (new_tier == tier)
+        return true;
+    if (new_tier < HARNESS_FULL || new_tier > HARNESS_PASSTHROUGH ||
+        HARNESS_TIER == HARNESS_PASSTHROUGH || allocation_check())
+        return false;
+    tier = new_tier;
+    return true;
+}
+
+int harness_tier()
+{
+    return tier;
+}
+
+const char *harness_tier_name(int t)
+{
+    static const char *names[] = {"full", "counting", "passthrough"};
+    return t >= HARNESS_FULL && t <= HARNESS_PASSTHROUGH ? names[t] : NULL;
+}
+
+/* Attribute the following allocations and frees to command name, which must
+ * stay valid, until the next call. Commands beyond MEMSTAT_COMMANDS are not
+ * tracked.
+ */
+void memstat_command(const char *name)
+{
+    memstat.command = NULL;
+    for (size_t i = 0; i < memstat.ncommands && !memstat.command; i++) {
+        if (!strcmp(memstat.commands[i].name, name))
+            memstat.command = &memstat.commands[i];
+    }
+    if (!memstat.command && memstat.ncommands < MEMSTAT_COMMANDS) {
+        memstat.command = &memstat.commands[memstat.ncommands++];
+        memstat.command->name = name;
+    }
+}
+
+/* Print the allocation statistics, one record per line. Each line names the
+ * record type followed by key=value fields, so it can be parsed easily.
+ */
+void memstat_report()
+{
+    report(1,
+           "total allocs=%zu frees=%zu live_blocks=%zu live_bytes=%zu "
+           "peak_bytes=%zu",
+           memstat.allocs, memstat.frees, allocation_check(),
+           memstat.live_bytes, memstat.peak_bytes);
+    for (int c = 0; c < MEMSTAT_CLASSES; c++) {
+        size_t min = c ? (size_t) 1 << (c - 1) : 0;
+        if (c == MEMSTAT_CLASSES - 1)
+            report(1, "class min=%zu max=inf allocs=%zu", min,
+                   memstat.classes[c]);
+        else
+            report(1, "class min=%zu max=%zu allocs=%zu", min,
+                   c ? 2 * min - 1 : 0, memstat.classes[c]);
+    }
+    for (size_t i = 0; i < memstat.ncommands; i++) {
+        const memstat_command_t *cmd = &memstat.commands[i];
+        if (cmd->allocs || cmd->frees)
+            report(1,
+                   "command name=%s allocs=%zu alloc_bytes=%zu frees=%zu "
+                   "free_bytes=%zu",
+                   cmd->name, cmd->allocs, cmd->alloc_bytes, cmd->frees,
+                   cmd->free_bytes);
+    }
+    /* Offsets into the executable can be fed to addr2line */
+    for (size_t i = 0; i < MEMSTAT_SITES; i++) {
+        const memstat_site_t *site = &memstat.sites[i];
+        if (site->site)
+            report(1, "site offset=%#tx allocs=%zu bytes=%zu",
+                   (const char *) site->site - &__executable_start,
+                   site->allocs, site->bytes);
+    }
+    if (memstat.sites_dropped)
+        report(1, "site offset=other allocs=%zu", memstat.sites_dropped);
+    if (arena_base)
+        arena_report();
+}
+
+/* Charge the following allocations to account, NULL for none */
+void mem_account_use(struct __mem_account *account)
+{
+    mem_owner = account;
+}
+
+/* Clear the statistics. Live blocks stay accounted for. */
+void memstat_reset()
+{
+    size_t live_bytes = memstat.live_bytes;
+    memstat_command_t *command = memstat.command;
+
+    memset(memstat.classes, 0, sizeof(memstat.classes));
+    memset(memstat.sites, 0, sizeof(memstat.sites));
+    for (size_t i = 0; i < memstat.ncommands; i++) {
+        memstat.commands[i].allocs = memstat.commands[i].alloc_bytes = 0;
+        memstat.commands[i].frees = memstat.commands[i].free_bytes = 0;
+    }
+    memstat.allocs = memstat.frees = memstat.sites_dropped = 0;
+    memstat.live_bytes = memstat.peak_bytes = live_bytes;
+    memstat.command = command;
 }
 
 /* Implementation of functions for testing */
 
+/* Pick up changed fault injection parameters, choosing and logging a seed
+ * if none was given.
+ */
+void fault_update()
+{
+    fault_commands = fault_allocs = 0;
+    fault_armed = fail_probability > 0 || fail_every > 0 || fail_after > 0;
+    fault_threshold = fail_probability > 0 && fail_probability < 100
+                          ? (uint64_t) fail_probability * (UINT64_MAX / 100)
+                          : 0;
+    if (!fault_armed)
+        return;
+
+    if (!fail_seed)
+        fail_seed = random() | 1;
+    report(1, "Fault injection armed, seed %d", fail_seed);
+    fault_state = random_shuffle(fail_seed);
+}
+
+/* Restart the fault injection schedules for the next command */
+void fault_command()
+{
+    fault_commands++;
+    fault_allocs = 0;
+    fault_state = random_shuffle(fail_seed + fault_commands);
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -258,61 +1526,284 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/* Release the state of a thread other than the main one as it exits */
+static void thread_release(void *arg)
+{
+    harness_thread_t *t = arg;
+    slab_flush(t, 0);
+    free(t);
+}
+
+static void thread_init()
+{
+    for (int i = 0; i < LIVE_SHARDS; i++)
+        pthread_mutex_init(&live_shards[i].lock, NULL);
+    pthread_mutex_init(&memstat.sites_lock, NULL);
+    pthread_mutex_init(&slab_lock, NULL);
+    pthread_mutex_init(&guard_lock, NULL);
+    pthread_mutex_init(&arena_lock, NULL);
+    pthread_mutex_init(&fault_lock, NULL);
+    if (pthread_key_create(&thread_key, thread_release))
+        report_event(MSG_FATAL, "Couldn't create thread-specific data key");
+}
+
+/* Set/unset thread-safe mode.
+ * Must be called with no other thread using the harness, which for turning
+ * it off means they must have exited.
+ */
+void set_thread_safe_mode(bool on)
+{
+    harness_thread_t *t = this_thread();
+    if (on)
+        pthread_once(&thread_once, thread_init);
+    else if (thread_safe)
+        slab_flush(t, 0);
+    thread_safe = on;
+    mem_set_shared(on);
+}
+
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
- */
-bool exception_setup(bool limit_time)
+static int64_t watchdog_now()
+{
+    struct timespec ts;
+    clock_gettime(WATCHDOG_CLOCK, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *watchdog(void *arg)
 {
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
+    pthread_mutex_lock(&watchdog_lock);
+    for (;;) {
+        int64_t now = watchdog_now(), due = atomic_load(&deadline);
+        if (due > 0 && now >= due) {
+            if (atomic_compare_exchange_strong(&deadline, &due, DEADLINE_FIRED))
+                pthread_kill(watchdog_target, SIGALRM);
+            continue;
         }
 
-        if (error_message)
-            report_event(MSG_ERROR, error_message);
-        error_message = "";
+        int64_t idle = time_limit > 0 ? time_limit : 1;
+        int64_t wake = due > 0 ? due : now + idle * 1000000000;
+        atomic_store(&watchdog_wake, wake);
+        struct timespec ts = {.tv_sec = wake / 1000000000,
+                              .tv_nsec = wake % 1000000000};
+        pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &ts);
+    }
+    return NULL;
+}
+
+/* Start the watchdog with every signal blocked, so that it never runs a
+ * signal handler itself.
+ */
+static bool watchdog_start()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&attr, WATCHDOG_CLOCK);
+#endif
+    pthread_cond_init(&watchdog_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    watchdog_target = pthread_self();
+    watchdog_running = !pthread_create(&thread, NULL, watchdog, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!watchdog_running) {
+        report_event(MSG_FATAL, "Couldn't start time limit watchdog");
         return false;
     }
+    pthread_detach(thread);
+    return true;
+}
+
+static void arm_time_limit()
+{
+    if (!watchdog_running && !watchdog_start())
+        return;
+
+    int64_t now = watchdog_now(), due = INT64_MAX;
+    if (time_limit > 0)
+        due = now + (int64_t) time_limit * 1000000000;
+    budget_due = time_budget > 0 && now + time_budget - budget_used < due;
+    if (budget_due)
+        due = now + time_budget - budget_used;
+    armed_at = now;
+    atomic_store(&deadline, due);
+    if (due < atomic_load(&watchdog_wake)) {
+        pthread_mutex_lock(&watchdog_lock);
+        pthread_cond_signal(&watchdog_cond);
+        pthread_mutex_unlock(&watchdog_lock);
+    }
+}
+
+/* Send SIGALRM again shortly for a deadline which has passed. Code still
+ * allocating is caught by then at its next allocation or free.
+ */
+static void refire_time_limit()
+{
+    int64_t fired = DEADLINE_FIRED, due = watchdog_now() + REFIRE_DELAY;
+    if (!atomic_compare_exchange_strong(&deadline, &fired, due))
+        return;
+    pthread_mutex_lock(&watchdog_lock);
+    pthread_cond_signal(&watchdog_cond);
+    pthread_mutex_unlock(&watchdog_lock);
+}
 
-    /* Got here from initial call */
-    jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
-        time_limited = true;
+static void disarm_time_limit()
+{
+    atomic_store(&deadline, DEADLINE_NONE);
+    if (time_budget)
+        budget_used += watchdog_now() - armed_at;
+}
+
+/* Whether the time limit of the running operation has expired. A SIGALRM
+ * raised for an operation which has completed since must be ignored.
+ */
+bool time_limit_exceeded()
+{
+    return atomic_load(&deadline) == DEADLINE_FIRED;
+}
+
+/* Whether the deadline which has expired was the time budget's */
+bool time_budget_exceeded()
+{
+    return time_limit_exceeded() && budget_due;
+}
+
+/* Give the risky code of the command about to run ms milliseconds in all */
+void set_time_budget(int ms)
+{
+    time_budget = (int64_t) ms * 1000000;
+    budget_used = 0;
+}
+
+/* Set the time limit in seconds, 0 to disable it */
+void set_time_limit(int seconds)
+{
+    time_limit = seconds;
+    if (watchdog_running) {
+        pthread_mutex_lock(&watchdog_lock);
+        pthread_cond_signal(&watchdog_cond);
+        pthread_mutex_unlock(&watchdog_lock);
+    }
+}
+
+/* Context exception_setup() saves to */
+sigjmp_buf *exception_env()
+{
+    return &this_thread()->env;
+}
+
+/* Initial return of exception_setup(). The watchdog only serves the main
+ * thread.
+ */
+bool exception_armed(bool limit_time)
+{
+    harness_thread_t *t = this_thread();
+    t->deferred = NULL;
+    t->holds = 0;
+    t->jmp_ready = true;
+    if (limit_time && (time_limit > 0 || time_budget > 0) &&
+        t == &main_thread) {
+        arm_time_limit();
+        t->time_limited = true;
     }
     return true;
 }
 
+/* Error return of exception_setup(), after the longjmp.
+ *
+ * The signal mask is not saved, which would take a system call each time.
+ * Instead, the signals whose handlers jump back are unblocked here.
+ */
+bool exception_caught()
+{
+    harness_thread_t *t = this_thread();
+    t->jmp_ready = false;
+    t->holds = 0;
+    if (t->time_limited) {
+        disarm_time_limit();
+        t->time_limited = false;
+    }
+
+    sigset_t caught;
+    sigemptyset(&caught);
+    sigaddset(&caught, SIGALRM);
+    sigaddset(&caught, SIGSEGV);
+    pthread_sigmask(SIG_UNBLOCK, &caught, NULL);
+
+    if (t->error_message)
+        report_event(MSG_ERROR, t->error_message);
+    t->error_message = "";
+    return false;
+}
+
 /* Call once past risky code */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
+    harness_thread_t *t = this_thread();
+    if (t->time_limited) {
+        disarm_time_limit();
+        t->time_limited = false;
     }
 
-    jmp_ready = false;
-    error_message = "";
+    t->jmp_ready = false;
+    t->holds = 0;
+    t->deferred = NULL;
+    t->error_message = "";
+}
+
+void exception_hold()
+{
+    this_thread()->holds++;
+}
+
+/* An exception held off is raised on release of the outermost hold */
+void exception_release()
+{
+    harness_thread_t *t = this_thread();
+    if (--t->holds == 0 && t->deferred)
+        trigger_exception(t->deferred);
+}
+
+bool exception_pending()
+{
+    return this_thread()->deferred;
+}
+
+/* Whether a faulting address lies in the guard page arena */
+bool guard_fault(const void *addr)
+{
+    return guard_owns(addr);
 }
 
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
+    /* May run in a signal handler, so the state is not created here */
+    harness_thread_t *t = self;
     error_occurred = true;
-    error_message = msg;
-    if (jmp_ready)
-        siglongjmp(env, 1);
-    else
+    if (!t || !t->jmp_ready)
         exit(1);
+    t->deferred = NULL;
+    t->error_message = msg;
+    siglongjmp(t->env, 1);
+}
+
+void trigger_exception_async(char *msg)
+{
+    harness_thread_t *t = self;
+    if (t && (t->busy || t->holds)) {
+        t->deferred = msg;
+        return;
+    }
+    trigger_exception(msg);
 }
@@ -10,20 +10,109 @@
  * allow checking for common allocation errors.
  */
 
+/* Checking tiers, from the most thorough to none at all. HARNESS_TIER picks
+ * the default at build time; building with the passthrough tier hands the
+ * tested program the library functions themselves.
+ */
+#define HARNESS_FULL 0        /* Detect corruption, double and invalid frees */
+#define HARNESS_COUNTING 1    /* Only count blocks and bytes */
+#define HARNESS_PASSTHROUGH 2 /* Plain library calls */
+
+#ifndef HARNESS_TIER
+#define HARNESS_TIER HARNESS_FULL
+#endif
+
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Hold off exceptions raised asynchronously, such as by the time limit,
+ * until the matching exception_release(), so that code building something
+ * out of several allocations is not cut short halfway. Holds may nest.
+ */
+void exception_hold();
+void exception_release();
+
+/* Whether an exception is being held off, for work long enough to be worth
+ * winding up early
+ */
+bool exception_pending();
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Start timing the allocations and frees of the calling thread, or stop and
+ * return how many nanoseconds they took since. Blocks freed meanwhile are
+ * only released when the clock stops.
+ */
+void harness_clock_start();
+double harness_clock_stop();
+
+/* Switch to another checking tier while no block is allocated. Return false
+ * if that is not possible, which includes leaving the passthrough tier of a
+ * passthrough build.
+ */
+bool set_harness_tier(int tier);
+
+/* Return the checking tier in use, and its name */
+int harness_tier();
+const char *harness_tier_name(int tier);
+
+/* Record the calling address of each allocation when nonzero */
+extern int memstat_sites;
+
+/* Attribute following allocations to console command name */
+void memstat_command(const char *name);
+
+/* Print allocation statistics in a machine-readable form */
+void memstat_report();
+
+/* Clear allocation statistics */
+void memstat_reset();
+
+/* Charge following allocations to account as well as to the total memory,
+ * NULL for the total only. Exceeding a cap fails the allocation. A block
+ * is released against the account it was charged to when freed.
+ */
+struct __mem_account;
+void mem_account_use(struct __mem_account *account);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Fail every Nth allocation of a command when positive */
+extern int fail_every;
+
+/* Fail the allocations of a command past the first N when positive */
+extern int fail_after;
+
+/* Seed of the fault injection, chosen at random when 0 */
+extern int fail_seed;
+
+/* Apply changes to the fault injection parameters above */
+void fault_update();
+
+/* Restart the fault injection schedules for a new command */
+void fault_command();
+
+/* Serve small allocations from the slab allocator when nonzero */
+extern int slab_mode;
+
+/* Place small allocations against guard pages when nonzero */
+extern int guard_mode;
+
+/* Serve allocations from the huge page arena when nonzero */
+extern int arena_mode;
+
+/* Whether a faulting address hit a guard page, past the end of a block.
+ * Freed guarded blocks are not protected, so using them does not fault.
+ */
+bool guard_fault(const void *addr);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -36,21 +125,69 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Set/unset thread-safe mode.
+ * In this mode, any number of threads may allocate and free blocks, and
+ * each has an exception context of its own. The time limit only applies to
+ * the thread which first used the harness. Only change it while no other
+ * thread uses the harness.
+ */
+void set_thread_safe_mode(bool thread_safe);
+
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Evaluates to true for initial return, false for error return.
+ * It is a macro, so that the longjmp lands in the frame of the caller, which
+ * is still live, rather than in one which has already returned.
  */
-bool exception_setup(bool limit_time);
+#define exception_setup(limit_time)                        \
+    (sigsetjmp(*exception_env(), 0) ? exception_caught() \
+                                    : exception_armed(limit_time))
+
+/* Parts of exception_setup() */
+sigjmp_buf *exception_env();
+bool exception_armed(bool limit_time);
+bool exception_caught();
 
 /* Call once past risky code */
 void exception_cancel();
 
+/* Set the time limit of risky code in seconds, 0 for none */
+void set_time_limit(int seconds);
+
+/* Whether a SIGALRM was raised for the risky code running now */
+bool time_limit_exceeded();
+
+/* Set a time budget in milliseconds, 0 for none, which the risky code of the
+ * command about to run shares. It is enforced like the time limit.
+ */
+void set_time_budget(int ms);
+
+/* Whether that SIGALRM was raised for the time budget */
+bool time_budget_exceeded();
+
 /* Use longjmp to return to most recent exception setup.  Include error message
  */
 void trigger_exception(char *msg);
 
+/* Same, from the handler of an asynchronous signal. An allocation or free
+ * under way is completed first, and so is a hold.
+ */
+void trigger_exception_async(char *msg);
+
+#elif HARNESS_TIER == HARNESS_PASSTHROUGH
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Tested program uses the library versions, even when naming ours */
+#define test_malloc malloc
+#define test_calloc calloc
+#define test_free free
+#define test_strdup strdup
+
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,6 +21,8 @@
 #include <time.h>
 #endif
 
+#include "complexity.h"
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -53,7 +57,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -67,6 +70,25 @@ typedef struct {
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* A queue context along with the memory charged to its queue */
+typedef struct {
+    queue_contex_t ctx;
+    mem_account_t mem;
+} queue_mem_t;
+
+#define queue_mem(qctx) container_of(qctx, queue_mem_t, ctx)
+
+/* Queues merged into another. Their accounts are kept, since the blocks
+ * they allocated are released against them.
+ */
+static LIST_HEAD(merged_queues);
+
+/* Memory cap of each queue in bytes (0: none) */
+static int queue_limit = 0;
+
+/* Time limit of each command in seconds (0: none) */
+static int time_limit = 1;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -78,6 +100,10 @@ static int descend = 0;
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+/* How many strings are handed to q_insert_*_bulk at a time */
+#define INSERT_BATCH 1024
+
 /* For queue_insert and queue_remove */
 typedef enum {
     POS_TAIL,
@@ -86,6 +112,13 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* Switch to queue context qctx, which queue memory is then charged to */
+static void set_current(queue_contex_t *qctx)
+{
+    current = qctx;
+    mem_account_use(qctx ? &queue_mem(qctx)->mem : NULL);
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -101,9 +134,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,13 +146,12 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
-        free(current);
+        free(queue_mem(current));
         chain.size--;
-        current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
+        set_current(qnext ? list_entry(qnext, queue_contex_t, chain) : NULL);
     }
 
     q_show(3);
@@ -148,14 +177,17 @@ static bool do_new(int argc, char *argv[])
     bool ok = true;
 
     if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+        queue_mem_t *qmem = calloc(1, sizeof(queue_mem_t));
+        queue_contex_t *qctx = &qmem->ctx;
         list_add_tail(&qctx->chain, &chain.head);
 
+        qmem->mem.limit = queue_limit;
+        mem_account_use(&qmem->mem);
         qctx->size = 0;
         qctx->q = q_new();
         qctx->id = chain.size++;
 
-        current = qctx;
+        set_current(qctx);
     }
     exception_cancel();
     q_show(3);
@@ -180,6 +212,134 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Record a failed insertion. Return false once failures exceed the limit */
+static bool insert_failed(const char *inserts)
+{
+    fail_count++;
+    if (fail_count < fail_limit) {
+        report(2, "Insertion of %s failed", inserts);
+        return true;
+    }
+    report(1, "ERROR: Insertion of %s failed (%d failures total)", inserts,
+           fail_count);
+    return false;
+}
+
+/* Check the element inserted last from string s for a private copy of s.
+ * When more than one element was inserted, its neighbour must not share it.
+ */
+static bool check_inserted(position_t pos, const char *s, bool has_neighbour)
+{
+    struct list_head *node =
+        pos == POS_TAIL ? current->q->prev : current->q->next;
+    struct list_head *neighbour = pos == POS_TAIL ? node->prev : node->next;
+    const char *cur_inserts = list_entry(node, element_t, list)->value;
+
+    if (!cur_inserts) {
+        report(1, "ERROR: Failed to save copy of string in queue");
+        return false;
+    }
+    if (s == cur_inserts) {
+        report(1,
+               "ERROR: Need to allocate and copy string for new queue element");
+        return false;
+    }
+    if (has_neighbour &&
+        list_entry(neighbour, element_t, list)->value == cur_inserts) {
+        report(1,
+               "ERROR: Need to allocate separate string for each queue "
+               "element");
+        return false;
+    }
+    return true;
+}
+
+/* Insert reps copies of inserts, or random strings when need_rand is set, in
+ * batches of INSERT_BATCH through q_insert_head_bulk/q_insert_tail_bulk.
+ */
+static bool queue_insert_bulk(position_t pos,
+                              char *inserts,
+                              bool need_rand,
+                              int reps)
+{
+    char randstr_bufs[INSERT_BATCH][MAX_RANDSTR_LEN];
+    char *strings[INSERT_BATCH];
+    bool ok = true;
+
+    for (int r = 0; ok && r < reps;) {
+        int n = reps - r < INSERT_BATCH ? reps - r : INSERT_BATCH;
+        for (int i = 0; i < n; i++) {
+            if (need_rand)
+                fill_rand_string(randstr_bufs[i], sizeof(randstr_bufs[i]));
+            strings[i] = need_rand ? randstr_bufs[i] : inserts;
+        }
+
+        for (int done = 0; ok && done < n;) {
+            char **batch = strings + done;
+            int cnt = pos == POS_TAIL
+                          ? q_insert_tail_bulk(current->q, batch, n - done)
+                          : q_insert_head_bulk(current->q, batch, n - done);
+            current->size += cnt;
+            if (r == 0 && done == 0 && cnt > 0)
+                ok = check_inserted(pos, strings[cnt - 1], cnt > 1);
+            done += cnt;
+            /* Skip the string whose element could not be allocated */
+            if (ok && done < n)
+                ok = insert_failed(strings[done++]);
+        }
+        r += n;
+        ok = ok && !error_check();
+    }
+    return ok;
+}
+
+/* Insert reps copies of inserts one at a time. When need_rand is set, inserts
+ * is a buffer of MAX_RANDSTR_LEN bytes refilled with a random string per rep.
+ */
+static bool queue_insert_each(position_t pos,
+                              char *inserts,
+                              bool need_rand,
+                              int reps)
+{
+    char *lasts = NULL;
+    bool ok = true;
+
+    for (int r = 0; ok && r < reps; r++) {
+        if (need_rand)
+            fill_rand_string(inserts, MAX_RANDSTR_LEN);
+        bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
+                                    : q_insert_head(current->q, inserts);
+        if (rval) {
+            current->size++;
+            element_t *entry =
+                pos == POS_TAIL ? list_last_entry(current->q, element_t, list)
+                                : list_first_entry(current->q, element_t, list);
+            char *cur_inserts = entry->value;
+            if (!cur_inserts) {
+                report(1, "ERROR: Failed to save copy of string in queue");
+                ok = false;
+            } else if (r == 0 && inserts == cur_inserts) {
+                report(1,
+                       "ERROR: Need to allocate and copy string for new "
+                       "queue element");
+                ok = false;
+                break;
+            } else if (r == 1 && lasts == cur_inserts) {
+                report(1,
+                       "ERROR: Need to allocate separate string for each "
+                       "queue element");
+                ok = false;
+                break;
+            }
+            lasts = cur_inserts;
+        } else {
+            ok = insert_failed(inserts);
+        }
+        ok = ok && !error_check();
+    }
+    return ok;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -199,7 +359,6 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         return ok;
     }
 
-    char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
@@ -226,49 +385,14 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    /* Large batches skip the per-element bookkeeping of queue_insert_each */
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
-            if (rval) {
-                current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
-                char *cur_inserts = entry->value;
-                if (!cur_inserts) {
-                    report(1, "ERROR: Failed to save copy of string in queue");
-                    ok = false;
-                } else if (r == 0 && inserts == cur_inserts) {
-                    report(1,
-                           "ERROR: Need to allocate and copy string for new "
-                           "queue element");
-                    ok = false;
-                    break;
-                } else if (r == 1 && lasts == cur_inserts) {
-                    report(1,
-                           "ERROR: Need to allocate separate string for each "
-                           "queue element");
-                    ok = false;
-                    break;
-                }
-                lasts = cur_inserts;
-            } else {
-                fail_count++;
-                if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
-                else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
-                    ok = false;
-                }
-            }
-            ok = ok && !error_check();
-        }
+        ok = reps > BIG_LIST_SIZE
+                 ? queue_insert_bulk(pos, inserts, need_rand, reps)
+                 : queue_insert_each(pos, inserts, need_rand, reps);
+    } else if (current) {
+        /* Cut short, so how many strings went in is unknown */
+        current->size = q_size(current->q);
     }
     exception_cancel();
 
@@ -862,17 +986,19 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
-        current = list_entry(chain.head.next, queue_contex_t, chain);
+        set_current(list_entry(chain.head.next, queue_contex_t, chain));
         current->size = len;
 
+        /* The first queue now holds the memory of all the others */
         struct list_head *cur = chain.head.next->next;
         while ((uintptr_t) cur != (uintptr_t) &chain.head) {
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(ctx->q);
-            free(ctx);
+            mem_transfer(&queue_mem(current)->mem, &queue_mem(ctx)->mem);
+            list_add_tail(&ctx->chain, &merged_queues);
         }
 
         chain.head.prev = &current->chain;
@@ -1010,6 +1136,154 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    struct list_head *cur;
+    if (argc == 2) {
+        memstat_reset();
+        mem_reset_peak(&mem_total);
+        list_for_each (cur, &chain.head)
+            mem_reset_peak(&queue_mem(list_entry(cur, queue_contex_t, chain))
+                                ->mem);
+        return true;
+    }
+
+    report(1, "harness tier=%s", harness_tier_name(harness_tier()));
+    memstat_report();
+    report(1, "memory total bytes=%zu peak_bytes=%zu limit=%zu",
+           mem_total.bytes, mem_total.peak, (size_t) mblimit << 20);
+    list_for_each (cur, &chain.head) {
+        queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
+        const mem_account_t *mem = &queue_mem(qctx)->mem;
+        report(1, "memory queue=%d bytes=%zu peak_bytes=%zu limit=%zu",
+               qctx->id, mem->bytes, mem->peak, mem->limit);
+    }
+    return true;
+}
+
+#define PARALLEL_MAX_THREADS 64
+
+/* Work of one thread of the parallel command */
+typedef struct {
+    int count;
+    bool ok;
+} parallel_job_t;
+
+/* Build a private queue of random strings, sort it, and drain it */
+static void *parallel_worker(void *arg)
+{
+    parallel_job_t *job = arg;
+    char buf[MAX_RANDSTR_LEN + 1], prev[MAX_RANDSTR_LEN + 1] = "";
+    struct list_head *q = NULL;
+
+    job->ok = false;
+    if (exception_setup(false)) {
+        q = q_new();
+        bool ok = q;
+        for (int i = 0; ok && i < job->count; i++) {
+            fill_rand_string(buf, MAX_RANDSTR_LEN);
+            ok = q_insert_head(q, buf);
+        }
+
+        if (ok) {
+            q_sort(q, false);
+            ok = q_size(q) == job->count;
+        }
+        while (ok && !list_empty(q)) {
+            element_t *e = q_remove_head(q, buf, sizeof(buf));
+            ok = e && strcmp(prev, buf) <= 0;
+            strcpy(prev, buf);
+            if (e)
+                q_release_element(e);
+        }
+        job->ok = ok;
+    }
+    exception_cancel();
+
+    if (q && exception_setup(false))
+        q_free(q);
+    exception_cancel();
+    return NULL;
+}
+
+static bool do_parallel(int argc, char *argv[])
+{
+    int nthreads, count = 1000;
+    if (argc < 2 || argc > 3 || !get_int(argv[1], &nthreads) ||
+        nthreads < 1 || nthreads > PARALLEL_MAX_THREADS ||
+        (argc == 3 && (!get_int(argv[2], &count) || count < 0))) {
+        report(1, "%s takes a number of threads up to %d and a length",
+               argv[0], PARALLEL_MAX_THREADS);
+        return false;
+    }
+
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    parallel_job_t jobs[PARALLEL_MAX_THREADS];
+    size_t blocks = allocation_check();
+    bool ok = true;
+    int started = 0;
+
+    /* The private queues are only charged to the total memory */
+    mem_account_use(NULL);
+    set_thread_safe_mode(true);
+    for (; started < nthreads; started++) {
+        jobs[started].count = count;
+        if (pthread_create(&threads[started], NULL, parallel_worker,
+                           &jobs[started])) {
+            report(1, "ERROR: Could not start thread %d", started);
+            ok = false;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok) {
+            report(1,
+                   "ERROR: Thread %d failed to build, sort or drain its "
+                   "queue",
+                   i);
+            ok = false;
+        }
+    }
+    set_thread_safe_mode(false);
+    set_current(current);
+
+    size_t leaked = allocation_check() - blocks;
+    if (leaked) {
+        report(1, "ERROR: Threads left %zu blocks allocated", leaked);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s takes an operation out of: %s", argv[0], complexity_ops);
+        report(1, "and optionally the model expected out of: %s",
+               complexity_models);
+        return false;
+    }
+
+    /* Charge the queues built for timing to no queue of ours */
+    size_t blocks = allocation_check();
+    mem_account_use(NULL);
+    bool ok = complexity_test(argv[1], argc == 3 ? argv[2] : NULL);
+    set_current(current);
+
+    size_t leaked = allocation_check() - blocks;
+    if (leaked) {
+        report(1, "ERROR: Timing left %zu blocks allocated", leaked);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1027,7 +1301,7 @@ static bool do_prev(int argc, char *argv[])
         prev = ((uintptr_t) chain.head.next == (uintptr_t) &current->chain)
                    ? chain.head.prev
                    : current->chain.prev;
-        current = prev ? list_entry(prev, queue_contex_t, chain) : NULL;
+        set_current(prev ? list_entry(prev, queue_contex_t, chain) : NULL);
     }
 
     return q_show(0);
@@ -1050,12 +1324,52 @@ static bool do_next(int argc, char *argv[])
         next = ((uintptr_t) chain.head.prev == (uintptr_t) &current->chain)
                    ? chain.head.next
                    : current->chain.next;
-        current = next ? list_entry(next, queue_contex_t, chain) : NULL;
+        set_current(next ? list_entry(next, queue_contex_t, chain) : NULL);
     }
 
     return q_show(0);
 }
 
+/* Apply a changed memory cap to the existing queues as well */
+static void queue_limit_setter(int oldval)
+{
+    struct list_head *cur;
+    list_for_each (cur, &chain.head)
+        queue_mem(list_entry(cur, queue_contex_t, chain))->mem.limit =
+            queue_limit;
+}
+
+static void time_limit_setter(int oldval)
+{
+    if (time_limit < 0)
+        time_limit = oldval;
+    set_time_limit(time_limit);
+}
+
+/* A timer is calibrated as soon as it is chosen */
+static void timer_setter(int oldval)
+{
+    if (!cpucycles_init()) {
+        report(1, "ERROR: Timer %d is not available", cpucycles_backend);
+        cpucycles_backend = oldval;
+    }
+}
+
+/* Fault injection parameters take effect through fault_update() */
+static void fault_setter(int oldval)
+{
+    fault_update();
+}
+
+/* Told about every command before it runs */
+static void begin_command(const char *name)
+{
+    memstat_command(name);
+    fault_command();
+    /* Freeing every queue on the way out is teardown, not work to bound */
+    set_time_budget(strcmp(name, "quit") ? cmd_time_budget() : 0);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1082,6 +1396,14 @@ static void console_init()
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(memstat, "Show or reset allocation statistics", "[reset]");
+    ADD_COMMAND(parallel,
+                "Build, sort and drain a private queue in each of n threads",
+                "n [len]");
+    ADD_COMMAND(complexity,
+                "Estimate how the running time of an operation grows with "
+                "queue length",
+                "op [model]");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1099,16 +1421,57 @@ static void console_init()
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
+              fault_setter);
+    add_param("failevery", &fail_every,
+              "Fail every Nth allocation of a command (0: never)",
+              fault_setter);
+    add_param("failafter", &fail_after,
+              "Fail allocations of a command after the first N (0: never)",
+              fault_setter);
+    add_param("failseed", &fail_seed,
+              "Seed of malloc failures (0: pick one and report it)",
+              fault_setter);
+    add_param("slab", &slab_mode,
+              "Serve small allocations from slab allocator (0/1)", NULL);
+    add_param("guard", &guard_mode,
+              "Catch overruns of small allocations with guard pages (0/1)",
               NULL);
+    add_param("hugearena", &arena_mode,
+              "Serve allocations from a huge page backed arena (0/1)", NULL);
+    add_param("timelimit", &time_limit,
+              "Time limit of each command in seconds (0: none)",
+              time_limit_setter);
+    add_param("qlimit", &queue_limit,
+              "Memory limit of each queue in bytes (0: none)",
+              queue_limit_setter);
+    add_param("memsites", &memstat_sites,
+              "Record allocation call sites for memstat (0/1)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sortalgo", &sort_algo,
+              "Sort algorithm (0: adaptive merge sort, 1: radix sort)", NULL);
+    add_param("sortthreads", &sort_threads,
+              "Number of threads sorting long queues", NULL);
+    add_param("timer", &cpucycles_backend,
+              "Timer of dudect (0: cycle counter, 1: serialized, 2: perf, "
+              "3: CLOCK_MONOTONIC_RAW)",
+              timer_setter);
+    add_param("sequential", &sequential_confidence,
+              "Confidence percent at which dudect stops a round early "
+              "(0: never)",
+              NULL);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+static void sigsegv_handler(int sig, siginfo_t *info, void *ucontext)
 {
+    if (guard_fault(info->si_addr))
+        trigger_exception(
+            "Segmentation fault occurred.  You accessed memory past the end "
+            "of a block");
+
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
@@ -1120,38 +1483,51 @@ static void sigsegv_handler(int sig)
 
 static void sigalrm_handler(int sig)
 {
-    trigger_exception(
-        "Time limit exceeded.  Either you are in an infinite loop, or your "
-        "code is too inefficient");
+    /* Ignore an alarm meant for an operation which has completed since */
+    if (!time_limit_exceeded())
+        return;
+    if (time_budget_exceeded())
+        trigger_exception_async("Time budget exceeded");
+    else
+        trigger_exception_async(
+            "Time limit exceeded.  Either you are in an infinite loop, or "
+            "your code is too inefficient");
 }
 
 static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    struct sigaction sa = {.sa_sigaction = sigsegv_handler,
+                           .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
         while (chain.size > 0) {
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
+            mem_account_use(&queue_mem(qctx)->mem);
             q_free(qctx->q);
-            free(qctx);
+            free(queue_mem(qctx));
             chain.size--;
         }
+        mem_account_use(NULL);
+
+        queue_contex_t *qctx, *safe;
+        list_for_each_entry_safe (qctx, safe, &merged_queues, chain)
+            free(queue_mem(qctx));
+        INIT_LIST_HEAD(&merged_queues);
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1165,11 +1541,15 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-t SECONDS][-c TIER]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-t SECONDS Time limit of each operation, 0 for none\n");
+    printf("\t-c TIER    Checking tier: full, counting or passthrough\n");
     exit(0);
 }
 
@@ -1382,7 +1762,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:t:c:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1407,6 +1787,30 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 't': {
+            char *endptr;
+            errno = 0;
+            long seconds = strtol(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg || seconds < 0 ||
+                seconds > INT_MAX) {
+                fprintf(stderr, "Invalid time limit\n");
+                exit(EXIT_FAILURE);
+            }
+            time_limit = seconds;
+            set_time_limit(seconds);
+            break;
+        }
+        case 'c': {
+            int tier = HARNESS_FULL;
+            while (harness_tier_name(tier) &&
+                   strcmp(optarg, harness_tier_name(tier)))
+                tier++;
+            if (!harness_tier_name(tier) || !set_harness_tier(tier)) {
+                fprintf(stderr, "Unavailable checking tier '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1438,7 +1842,11 @@ int main(int argc, char *argv[])
     if (logfile_name)
         set_logfile(logfile_name);
 
+    if (harness_tier() != HARNESS_FULL)
+        report(1, "Checking tier: %s", harness_tier_name(harness_tier()));
+
     add_quit_helper(q_quit);
+    set_cmd_observer(begin_command);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
@@ -1,18 +1,17 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "queue.h"
 
 #define new_q_element() ((element_t *) test_malloc(sizeof(element_t)))
 #define q_entry(node) list_entry(node, element_t, list)
+#define q_header(h) list_entry(h, queue_t, head)
 #define ctx_entry(node) list_entry(node, queue_contex_t, chain)
-#define swap(x, y, tmp) \
-    {                   \
-        tmp = x;        \
-        x = y;          \
-        y = tmp;        \
-    }
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -20,15 +19,31 @@
  *   cppcheck-suppress nullPointer
  */
 
+int sort_algo = SORT_MERGE;
+int sort_threads = 1;
+
+/* Set when the time limit expires during a parallel sort, telling the
+ * threads to hand back their nodes as they are
+ */
+static _Atomic bool sort_cancelled = false;
+
+/* Whether a sort should hand back its nodes as they are, because the time
+ * limit expired during a parallel sort or while a sort held it off
+ */
+static inline bool sort_stopped()
+{
+    return sort_cancelled || exception_pending();
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head =
-        (struct list_head *) test_malloc(sizeof(struct list_head));
-    if (!head)
+    queue_t *q = (queue_t *) test_malloc(sizeof(queue_t));
+    if (!q)
         return NULL;
-    INIT_LIST_HEAD(head);
-    return head;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    return &q->head;
 }
 
 /* Free all storage used by queue */
@@ -41,7 +56,46 @@ void q_free(struct list_head *head)
         list_del(&entry->list);
         q_release_element(entry);
     }
-    free(head);
+    free(q_header(head));
+}
+
+/* Allocate an element holding a copy of s */
+element_t *q_new_element(const char *s)
+{
+    element_t *new_node = new_q_element();
+    if (!new_node)
+        return NULL;
+
+    /* Keep short strings next to the list node to save an allocation */
+    size_t len = strlen(s) + 1;
+    if (len <= sizeof(new_node->inline_value)) {
+        new_node->value = memcpy(new_node->inline_value, s, len);
+    } else {
+        new_node->value = test_malloc(len);
+        if (new_node->value == NULL) {
+            free(new_node);
+            return NULL;
+        }
+        memcpy(new_node->value, s, len);
+    }
+
+    new_node->prefix = 0;
+    for (int i = 0; i < 8 && s[i]; i++)
+        new_node->prefix |= (uint64_t) (unsigned char) s[i] << (56 - 8 * i);
+    return new_node;
+}
+
+/* strcmp() of the strings of two elements, decided on their prefixes unless
+ * both strings share the first 8 bytes.
+ */
+int q_compare(const element_t *a, const element_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    /* A string shorter than 8 bytes ends within its prefix */
+    if (!(a->prefix & 0xff))
+        return 0;
+    return strcmp(a->value + 8, b->value + 8);
 }
 
 /* Insert an element at head of queue */
@@ -52,17 +106,12 @@ bool q_insert_common(struct list_head *head,
     if (!head)
         return false;
 
-    element_t *new_node = new_q_element();
+    element_t *new_node = q_new_element(s);
     if (!new_node)
         return false;
 
-    new_node->value = test_strdup(s);
-    if (new_node->value == NULL) {
-        free(new_node);
-        return false;
-    }
-
     insert_fn(&new_node->list, head);
+    q_header(head)->size++;
     return true;
 }
 
@@ -78,6 +127,46 @@ bool q_insert_tail(struct list_head *head, char *s)
     return q_insert_common(head, s, list_add_tail);
 }
 
+int q_insert_bulk(struct list_head *head,
+                  char **strings,
+                  int n,
+                  void (*insert_fn)(struct list_head *, struct list_head *),
+                  void (*splice_fn)(struct list_head *, struct list_head *))
+{
+    if (!head)
+        return 0;
+
+    /* The batch is reachable from nowhere else until spliced, so a time
+     * limit expiring meanwhile must wait for it
+     */
+    exception_hold();
+    LIST_HEAD(batch);
+    int cnt = 0;
+    for (; cnt < n; cnt++) {
+        element_t *new_node = q_new_element(strings[cnt]);
+        if (!new_node)
+            break;
+        insert_fn(&new_node->list, &batch);
+    }
+
+    splice_fn(&batch, head);
+    q_header(head)->size += cnt;
+    exception_release();
+    return cnt;
+}
+
+/* Insert a batch of elements at head of queue */
+int q_insert_head_bulk(struct list_head *head, char **strings, int n)
+{
+    return q_insert_bulk(head, strings, n, list_add, list_splice);
+}
+
+/* Insert a batch of elements at tail of queue */
+int q_insert_tail_bulk(struct list_head *head, char **strings, int n)
+{
+    return q_insert_bulk(head, strings, n, list_add_tail, list_splice_tail);
+}
+
 element_t *q_remove_mid(struct list_head *head,
                         struct list_head *target,
                         char *sp,
@@ -86,6 +175,7 @@ element_t *q_remove_mid(struct list_head *head,
     if (!head || list_empty(head))
         return NULL;
     list_del(target);
+    q_header(head)->size--;
     if (sp) {
         strncpy(sp, q_entry(target)->value, bufsize - 1);
         sp[bufsize - 1] = '\0';
@@ -110,13 +200,7 @@ int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
-
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        len++;
-    return len;
+    return q_header(head)->size;
 }
 
 /* Delete the middle node in queue */
@@ -124,18 +208,12 @@ bool q_delete_mid(struct list_head *head)
 {
     if (!head || list_empty(head))
         return false;
+    queue_t *q = q_header(head);
     struct list_head *mid = head->next;
-    struct list_head *curr = head->next;
-    int cnt = 0;
-    while (curr != head) {
-        if ((cnt & 1) == 1)
-            mid = mid->next;
-        cnt++;
-        curr = curr->next;
-    }
-    if (mid == head)
-        return false;
+    for (int i = q->size / 2; i > 0; i--)
+        mid = mid->next;
     list_del(mid);
+    q->size--;
     q_release_element(q_entry(mid));
     return true;
 }
@@ -149,7 +227,7 @@ bool q_delete_dup(struct list_head *head)
     while (curr != head) {
         bool isDup = false;
         while (curr->next != head &&
-               strcmp(q_entry(curr)->value, q_entry(curr->next)->value) == 0) {
+               q_compare(q_entry(curr), q_entry(curr->next)) == 0) {
             isDup = true;
             curr = curr->next;
         }
@@ -161,6 +239,7 @@ bool q_delete_dup(struct list_head *head)
             while (rm_target != curr_next) {
                 rm_next_target = rm_target->next;
                 q_release_element(q_entry(rm_target));
+                q_header(head)->size--;
                 rm_target = rm_next_target;
             }
         } else {
@@ -204,201 +283,561 @@ void q_reverse(struct list_head *head)
 {
     if (!head || list_empty(head))
         return;
-    // Reverse c-str ptr address
-    char *tmp_for_swap = NULL;
-    element_t *forward_e = NULL, *backward_e = NULL;
-    for (forward_e = q_entry(head->next), backward_e = q_entry(head->prev);
-         forward_e != backward_e; forward_e = q_entry(forward_e->list.next),
-        backward_e = q_entry(backward_e->list.prev)) {
-        swap(backward_e->value, forward_e->value, tmp_for_swap);
-        if (forward_e->list.next == &backward_e->list)
-            break;
+    // Strings may live inside their elements, so relink the nodes
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, head)
+        list_move(node, head);
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || list_empty(head) || k < 2)
+        return;
+    // Move each node of a group right behind the node preceding the group
+    struct list_head *anchor = head;
+    for (int left = q_header(head)->size; left >= k; left -= k) {
+        struct list_head *node = anchor->next, *first = node;
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            list_move(node, anchor);
+            node = next;
+        }
+        anchor = first;
     }
 }
 
-void q_reverse_only_k(struct list_head *front, int k)
+void break_circular(struct list_head *head)
+{
+    head->prev->next = NULL;
+}
+
+/* Three-way comparison of two elements in the requested sort order */
+static inline int cmp_elements(struct list_head *a,
+                               struct list_head *b,
+                               bool descend)
+{
+    int cmp = q_compare(q_entry(a), q_entry(b));
+    return descend ? (cmp < 0) - (cmp > 0) : cmp;
+}
+
+/* Restore the prev links and circularity of a queue whose elements were
+ * rearranged as the null-terminated list first.
+ */
+void rebuild_prev(struct list_head *head, struct list_head *first)
 {
-    // Reverse c-str ptr address
-    // Init back
-    struct list_head *back = front;
-    for (int i = 1; i < k; i++) {
-        back = back->next;
+    struct list_head *prev = head;
+    for (struct list_head *node = first; node; node = node->next) {
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
     }
-    // Reverse
-    char *tmp_for_swap = NULL;
-    while (front != back) {
-        swap(q_entry(front)->value, q_entry(back)->value, tmp_for_swap);
-        if (front->next == back)
-            break;
+    prev->next = head;
+    head->prev = prev;
+}
 
-        front = front->next;
-        back = back->prev;
+/* A sorted run of the adaptive merge sort, linked through next only */
+struct run {
+    struct list_head *head, *tail;
+    size_t len;
+};
+
+/* Consecutive wins after which a merge switches to galloping */
+#define MIN_GALLOP 7
+
+/* Shorter natural runs are extended by binary insertion sort */
+#define MIN_RUN 32
+
+/* Deep enough for runs obeying the stack invariants of merge_collapse() on
+ * any list which fits in memory.
+ */
+#define MAX_PENDING_RUNS 85
+
+/* Top up a run shorter than MIN_RUN with the nodes following it by binary
+ * insertion over an array of its nodes.
+ */
+void extend_run(struct run *run, struct list_head **list, bool descend)
+{
+    struct list_head *nodes[MIN_RUN], *next = *list;
+    size_t len = 0;
+
+    for (struct list_head *node = run->head; node; node = node->next)
+        nodes[len++] = node;
+    for (; next && len < MIN_RUN; len++) {
+        size_t lo = 0, hi = len;
+        /* Go behind the equal elements to stay stable */
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cmp_elements(next, nodes[mid], descend) < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        memmove(&nodes[lo + 1], &nodes[lo], (len - lo) * sizeof(*nodes));
+        nodes[lo] = next;
+        next = next->next;
     }
+
+    for (size_t i = 0; i + 1 < len; i++)
+        nodes[i]->next = nodes[i + 1];
+    nodes[len - 1]->next = NULL;
+    run->head = nodes[0];
+    run->tail = nodes[len - 1];
+    run->len = len;
+    *list = next;
 }
 
-/* Reverse the nodes of the list k at a time */
-void q_reverseK(struct list_head *head, int k)
+/* Cut the longest run off the front of the null-terminated list. A strictly
+ * descending run is reversed in place, which keeps the sort stable. Runs
+ * shorter than MIN_RUN are topped up by extend_run(), which is cheaper than
+ * merging many tiny runs of random input.
+ */
+struct run find_run(struct list_head **list, bool descend)
 {
-    if (!head || list_empty(head))
-        return;
-    struct list_head *curr = head->next, *end = head->next;
-    while (curr != head) {
-        int cnt = 0;
-        while (cnt < k && end != head) {
-            end = end->next;
-            cnt++;
+    struct list_head *node = *list, *next = node->next;
+    struct run run = {node, node, 1};
+
+    if (next && cmp_elements(next, node, descend) < 0) {
+        node->next = NULL;
+        while (next && cmp_elements(next, run.head, descend) < 0) {
+            struct list_head *after = next->next;
+            next->next = run.head;
+            run.head = next;
+            next = after;
+            run.len++;
         }
-        if (cnt != k)
-            break;
-        q_reverse_only_k(curr, k);
-        curr = end;
+    } else {
+        while (next && cmp_elements(next, run.tail, descend) >= 0) {
+            run.tail = next;
+            next = next->next;
+            run.len++;
+        }
+        run.tail->next = NULL;
     }
+
+    if (next && run.len < MIN_RUN)
+        extend_run(&run, &next, descend);
+    *list = next;
+    return run;
 }
 
-void break_circular(struct list_head *head)
+/* Whether node may be emitted before key: inclusive keeps equal elements of
+ * the left run in front, which is what makes the merge stable.
+ */
+static inline bool goes_before(struct list_head *node,
+                               struct list_head *key,
+                               bool inclusive,
+                               bool descend)
 {
-    head->prev->next = NULL;
+    int cmp = cmp_elements(node, key, descend);
+    return inclusive ? cmp <= 0 : cmp < 0;
 }
 
-bool cmp_in_sort(struct list_head *a, struct list_head *b, bool descend)
+/* Return the last node of the list starting at node which goes before key.
+ * node itself must go before key. Probes exponentially growing distances
+ * and then bisects the last gap, so a stretch of k nodes costs O(log k)
+ * comparisons.
+ */
+struct list_head *gallop(struct list_head *node,
+                         struct list_head *key,
+                         bool inclusive,
+                         bool descend)
 {
-    const element_t *ele_a = q_entry(a);
-    const element_t *ele_b = q_entry(b);
-    int cmp = strcmp(ele_a->value, ele_b->value);
-    return descend ? (cmp > 0) : (cmp < 0);
+    size_t step = 1;
+    for (;;) {
+        struct list_head *probe = node;
+        size_t gap = 0;
+        while (gap < step && probe->next) {
+            probe = probe->next;
+            gap++;
+        }
+        if (!gap)
+            return node;
+        if (goes_before(probe, key, inclusive, descend)) {
+            node = probe;
+            step <<= 1;
+            continue;
+        }
+
+        /* The answer lies in [node, probe) which is gap nodes wide */
+        while (gap > 1) {
+            size_t half = gap / 2;
+            struct list_head *mid = node;
+            for (size_t i = 0; i < half; i++)
+                mid = mid->next;
+            if (goes_before(mid, key, inclusive, descend)) {
+                node = mid;
+                gap -= half;
+            } else {
+                gap = half;
+            }
+        }
+        return node;
+    }
 }
 
-struct list_head *merge(bool descend, struct list_head *b, struct list_head *a)
+/* Stable merge of run a with the run b following it */
+struct run merge_runs(struct run a, struct run b, bool descend)
 {
-    struct list_head *head = NULL, **tail = &head;
+    struct run merged = {NULL, NULL, a.len + b.len};
+
+    /* Presorted input: the runs only need to be concatenated */
+    if (cmp_elements(b.head, a.tail, descend) >= 0) {
+        a.tail->next = b.head;
+        merged.head = a.head;
+        merged.tail = b.tail;
+        return merged;
+    }
+    if (cmp_elements(a.head, b.tail, descend) > 0) {
+        b.tail->next = a.head;
+        merged.head = b.head;
+        merged.tail = a.tail;
+        return merged;
+    }
 
-    while (a && b) {
-        if (cmp_in_sort(a, b, descend)) {
-            *tail = a;
-            tail = &a->next;
-            a = a->next;
+    struct list_head **tail = &merged.head, *x = a.head, *y = b.head;
+    int wins_x = 0, wins_y = 0;
+    while (x && y) {
+        struct list_head *last;
+        if (goes_before(x, y, true, descend)) {
+            last = ++wins_x >= MIN_GALLOP ? gallop(x, y, true, descend) : x;
+            wins_y = 0;
+            *tail = x;
+            x = last->next;
         } else {
-            *tail = b;
-            tail = &b->next;
-            b = b->next;
+            last = ++wins_y >= MIN_GALLOP ? gallop(y, x, false, descend) : y;
+            wins_x = 0;
+            *tail = y;
+            y = last->next;
         }
+        tail = &last->next;
     }
-    *tail = a ? a : b;
-
-    return head;
+    *tail = x ? x : y;
+    merged.tail = x ? a.tail : b.tail;
+    return merged;
 }
 
-void merge_final(bool descend,
-                 struct list_head *head,
-                 struct list_head *b,
-                 struct list_head *a)
+/* Merge the pending runs at index i and i + 1 */
+static inline void merge_at(struct run *runs, int *n, int i, bool descend)
 {
-    struct list_head **tail = &head->next, *prev = head;
+    runs[i] = merge_runs(runs[i], runs[i + 1], descend);
+    for (i++; i + 1 < *n; i++)
+        runs[i] = runs[i + 1];
+    (*n)--;
+}
 
-    while (a && b) {
-        if (cmp_in_sort(a, b, descend)) {
-            *tail = a;
-            a->prev = prev;
-            prev = a;
-            tail = &a->next;
-            a = a->next;
+/* Merge pending runs until their lengths shrink faster than Fibonacci
+ * numbers toward the top of the stack, which bounds its depth and keeps
+ * merges balanced.
+ */
+void merge_collapse(struct run *runs, int *n, bool descend)
+{
+    while (*n > 1) {
+        int i = *n - 2;
+        if ((i > 0 && runs[i - 1].len <= runs[i].len + runs[i + 1].len) ||
+            (i > 1 && runs[i - 2].len <= runs[i - 1].len + runs[i].len)) {
+            if (runs[i - 1].len < runs[i + 1].len)
+                i--;
+        } else if (runs[i].len > runs[i + 1].len) {
+            break;
+        }
+        merge_at(runs, n, i, descend);
+    }
+}
 
-        } else {
-            *tail = b;
-            b->prev = prev;
-            prev = b;
-            tail = &b->next;
-            b = b->next;
+/* Sort the null-terminated list and return its new first node. Only the next
+ * links are maintained.
+ */
+struct list_head *sort_list(struct list_head *list, bool descend)
+{
+    struct run runs[MAX_PENDING_RUNS];
+    int n = 0;
+
+    while (list) {
+        runs[n++] = find_run(&list, descend);
+        merge_collapse(runs, &n, descend);
+        if (sort_stopped()) {
+            for (int i = 0; i + 1 < n; i++)
+                runs[i].tail->next = runs[i + 1].head;
+            runs[n - 1].tail->next = list;
+            return runs[0].head;
         }
     }
-    *tail = a ? a : b;
+    while (n > 1)
+        merge_at(runs, &n, n - 2, descend);
+    return runs[0].head;
+}
+
+/* Describe the null-terminated list of len nodes starting at head as a run */
+struct run as_run(struct list_head *head, size_t len)
+{
+    struct run run = {head, head, len};
+    while (run.tail->next)
+        run.tail = run.tail->next;
+    return run;
+}
 
-    // Make rest linked list nodes doubly linked
-    while (*tail) {
-        (*tail)->prev = prev;
-        prev = *tail;
-        tail = &(*tail)->next;
+/* Buckets smaller than this are handed over to sort_list() */
+#define RADIX_CUTOFF 32
+
+/* Deepest byte the radix sort distributes on before comparing whole strings.
+ * Every level keeps 256 buckets on the stack, 6 KiB, and sorting may run on
+ * threads with small default stacks, so it stops at the end of the prefix
+ * cached in the element, which is also where reading bytes gets slower.
+ */
+#define RADIX_MAX_DEPTH 8
+
+/* Byte of the string at depth, read from the prefix while it covers it */
+static inline unsigned char radix_byte(const element_t *e, size_t depth)
+{
+    if (depth < 8)
+        return e->prefix >> (56 - 8 * depth);
+    return e->value[depth];
+}
+
+/* Stable MSD radix sort of the null-terminated list of len nodes whose
+ * strings agree on their first depth bytes. Bucket 0 collects the strings
+ * ending at depth, which are equal and stay in their original order.
+ */
+struct run radix_sort(struct list_head *list,
+                      size_t len,
+                      size_t depth,
+                      bool descend)
+{
+    if (len < RADIX_CUTOFF || depth >= RADIX_MAX_DEPTH || sort_stopped())
+        return as_run(sort_list(list, descend), len);
+
+    struct run buckets[256] = {0};
+    for (struct list_head *node = list; node; node = node->next) {
+        unsigned char c = radix_byte(q_entry(node), depth);
+        if (buckets[c].len++)
+            buckets[c].tail->next = node;
+        else
+            buckets[c].head = node;
+        buckets[c].tail = node;
     }
-    // Make list circular
-    head->prev = prev;
-    prev->next = head;
+
+    struct run sorted = {NULL, NULL, len};
+    struct list_head **tail = &sorted.head;
+    for (int i = 0; i < 256; i++) {
+        int c = descend ? 255 - i : i;
+        if (!buckets[c].len)
+            continue;
+        buckets[c].tail->next = NULL;
+        if (c && buckets[c].len > 1)
+            buckets[c] =
+                radix_sort(buckets[c].head, buckets[c].len, depth + 1, descend);
+        *tail = buckets[c].head;
+        tail = &buckets[c].tail->next;
+        sorted.tail = buckets[c].tail;
+    }
+    return sorted;
 }
 
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+/* Sort the null-terminated list of len nodes with the selected engine */
+struct run sort_segment(struct list_head *list, size_t len, bool descend)
 {
-    // Ref from
-    // list_sort.c(https://github.com/torvalds/linux/blob/master/lib/list_sort.c)
-    // with the help of 你所不知道的 C 語言: linked list 和非連續記憶體
-    // (https://hackmd.io/@sysprog/c-linked-list#Linux-%E6%A0%B8%E5%BF%83%E7%9A%84-list_sort-%E5%AF%A6%E4%BD%9C)
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+    if (sort_algo == SORT_RADIX)
+        return radix_sort(list, len, 0, descend);
 
-    struct list_head *list = head->next, *pending = NULL;
-    size_t count = 0; /* Count of pending */
+    return as_run(sort_list(list, descend), len);
+}
 
-    break_circular(head);
-    do {
-        size_t bits;
-        struct list_head **tail = &pending;
-
-        /* Find the least-significant clear bit in count */
-        for (bits = count; bits & 1; bits >>= 1)
-            tail = &(*tail)->prev;
-        /* Do the indicated merge */
-        if (bits) {
-            struct list_head *a = *tail, *b = a->prev;
-
-            a = merge(descend, b, a);
-            /* Install the merged result in place of the inputs */
-            a->prev = b->prev;
-            *tail = a;
+/* Shorter queues are not worth the thread start-up */
+#define PARALLEL_SORT_MIN 32768
+
+#define MAX_SORT_THREADS 64
+
+/* Work of one thread: sort run, or merge other into it when other is set */
+struct sort_task {
+    struct run run, other;
+    bool descend;
+};
+
+void *sort_worker(void *arg)
+{
+    struct sort_task *task = arg;
+    if (task->other.head)
+        task->run = merge_runs(task->run, task->other, task->descend);
+    else
+        task->run = sort_segment(task->run.head, task->run.len, task->descend);
+    return NULL;
+}
+
+static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sort_done = PTHREAD_COND_INITIALIZER;
+static int sort_pending;
+
+void *sort_thread(void *arg)
+{
+    sort_worker(arg);
+    pthread_mutex_lock(&sort_lock);
+    if (!--sort_pending)
+        pthread_cond_signal(&sort_done);
+    pthread_mutex_unlock(&sort_lock);
+    return NULL;
+}
+
+/* Run the n tasks on threads of their own, which take no signals, and wait
+ * for them, checking every millisecond whether the time limit has expired.
+ * A task whose thread cannot be created is run by the caller.
+ */
+void run_sort_tasks(struct sort_task **tasks, int n)
+{
+    pthread_t threads[MAX_SORT_THREADS];
+    bool started[MAX_SORT_THREADS] = {false};
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    sort_pending = n;
+    for (int i = 0; i < n; i++)
+        started[i] = !pthread_create(&threads[i], NULL, sort_thread, tasks[i]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (int i = 0; i < n; i++) {
+        if (!started[i])
+            sort_thread(tasks[i]);
+    }
+
+    pthread_mutex_lock(&sort_lock);
+    while (sort_pending) {
+        struct timespec tick;
+        clock_gettime(CLOCK_REALTIME, &tick);
+        tick.tv_nsec += 1000000;
+        if (tick.tv_nsec >= 1000000000) {
+            tick.tv_sec++;
+            tick.tv_nsec -= 1000000000;
         }
+        pthread_cond_timedwait(&sort_done, &sort_lock, &tick);
 
-        /* Move one element from input list to pending */
-        // Remove from list's head. Insert from pending's tail.
-        list->prev = pending;
-        pending = list;
-        list = list->next;
-        pending->next = NULL;
-        count++;
-    } while (list);
-    /* End of input; merge together all the pending lists. */
-    list = pending;
-    pending = pending->prev;
-    for (;;) {
-        struct list_head *next = pending->prev;
+        sigset_t pending;
+        sigpending(&pending);
+        if (sigismember(&pending, SIGALRM))
+            sort_cancelled = true;
+    }
+    pthread_mutex_unlock(&sort_lock);
 
-        if (!next)
-            break;
-        list = merge(descend, pending, list);
-        pending = next;
+    for (int i = 0; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
     }
-    // Maintain the prev ptr
-    merge_final(descend, head, pending, list);
 }
 
-int q_ascend_descend(struct list_head *head,
-                     struct list_head *curr,
-                     bool descend,
-                     char **pivot)
+/* Sort the len nodes of the queue at head on nthreads threads. The list is
+ * cut into nthreads segments, which are sorted concurrently, and then
+ * neighbouring segments are merged pairwise, concurrently again, until one
+ * is left. Merging a segment only with the one right behind it keeps the
+ * sort stable.
+ */
+void parallel_sort(struct list_head *head,
+                   size_t len,
+                   int nthreads,
+                   bool descend)
 {
-    int q_sz = 0;
-    if (curr->next != head) {
-        q_sz = q_ascend_descend(head, curr->next, descend, pivot);
+    struct sort_task segments[MAX_SORT_THREADS], *tasks[MAX_SORT_THREADS];
+    struct list_head *list = head->next;
+
+    for (int i = 0; i < nthreads; i++) {
+        size_t seg_len = len / nthreads + (i < len % nthreads);
+        struct list_head *last = list;
+        for (size_t j = 1; j < seg_len; j++)
+            last = last->next;
+        segments[i] = (struct sort_task){{list, last, seg_len}, {0}, descend};
+        tasks[i] = &segments[i];
+        list = last->next;
+        last->next = NULL;
+    }
+
+    /* The time limit handler longjmps out of whatever it interrupts, which
+     * must not leave threads running on the queue. Its signal is held back
+     * until the queue is whole again; if it comes meanwhile, the threads
+     * stop sorting and the segments are relinked as they are.
+     */
+    sigset_t alarm, old;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &old);
+    sort_cancelled = false;
+
+    run_sort_tasks(tasks, nthreads);
+    int step = 1;
+    for (; step < nthreads && !sort_cancelled; step *= 2) {
+        int n = 0;
+        for (int i = 0; i + step < nthreads; i += 2 * step) {
+            segments[i].other = segments[i + step].run;
+            tasks[n++] = &segments[i];
+        }
+        run_sort_tasks(tasks, n);
     }
-    element_t *target = q_entry(curr);
-    int cmp = strcmp(target->value, *pivot);
-    if ((descend && (cmp >= 0)) || (!descend && (cmp <= 0))) {
-        *pivot = target->value;
-        q_sz++;
+    for (int i = 0; i + step < nthreads; i += step)
+        segments[i].run.tail->next = segments[i + step].run.head;
+
+    rebuild_prev(head, segments[0].run.head);
+    sort_cancelled = false;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    // Natural merge sort in the spirit of Timsort
+    // (https://github.com/python/cpython/blob/main/Objects/listsort.txt):
+    // existing ascending and strictly descending runs are taken as they are,
+    // so presorted input costs about n comparisons. The radix engine
+    // trades that for O(n * k) byte lookups on long random queues.
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    size_t len = q_header(head)->size;
+    int nthreads = sort_threads < MAX_SORT_THREADS ? sort_threads
+                                                    : MAX_SORT_THREADS;
+    break_circular(head);
+    if (nthreads > 1 && len >= PARALLEL_SORT_MIN) {
+        parallel_sort(head, len, nthreads, descend);
     } else {
-        curr->prev->next = curr->next;
-        curr->next->prev = curr->prev;
-        q_release_element(q_entry(curr));
+        /* Stopping early leaves the queue whole but not sorted */
+        exception_hold();
+        rebuild_prev(head, sort_segment(head->next, len, descend).head);
+        exception_release();
+    }
+}
+
+/* Release the elements linked after first up to, not including, last */
+void release_between(struct list_head *first, struct list_head *last)
+{
+    for (struct list_head *node = first->next, *next; node != last;
+         node = next) {
+        next = node->next;
+        q_release_element(q_entry(node));
     }
+}
 
-    return q_sz;
+/* Walk the queue backwards keeping every element which is not beaten by the
+ * last one kept, and return how many are kept. The elements dropped between
+ * two kept ones are unlinked together and released in one go.
+ */
+int q_ascend_descend(struct list_head *head, bool descend)
+{
+    struct list_head *kept = head->prev;
+    int size = 1;
+
+    for (struct list_head *node = kept->prev, *prev; node != head;
+         node = prev) {
+        prev = node->prev;
+        int cmp = q_compare(q_entry(node), q_entry(kept));
+        if (descend ? cmp < 0 : cmp > 0)
+            continue;
+        release_between(node, kept);
+        node->next = kept;
+        kept->prev = node;
+        kept = node;
+        size++;
+    }
+    release_between(head, kept);
+    head->next = kept;
+    kept->prev = head;
+    return size;
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
@@ -407,8 +846,8 @@ int q_ascend(struct list_head *head)
 {
     if (!head || list_empty(head) || list_is_singular(head))
         return q_size(head);
-    char *min = "~~~~~~~";
-    return q_ascend_descend(head, head->next, false, &min);
+    q_header(head)->size = q_ascend_descend(head, false);
+    return q_header(head)->size;
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
@@ -417,47 +856,81 @@ int q_descend(struct list_head *head)
 {
     if (!head || list_empty(head) || list_is_singular(head))
         return q_size(head);
-    char *max = "";
-    return q_ascend_descend(head, head->next, true, &max);
+    q_header(head)->size = q_ascend_descend(head, true);
+    return q_header(head)->size;
 }
 
-bool list_is_2(struct list_head *head)
+/* Queues merged in one pass of the loser tree, a power of two */
+#define MERGE_WAYS 64
+
+/* Whether the current node of source i goes before that of source j. An
+ * exhausted source goes last and ties go to the earlier queue, which keeps
+ * the merge stable.
+ */
+static inline bool source_before(struct list_head **cur,
+                                 int i,
+                                 int j,
+                                 bool descend)
 {
-    const struct list_head *head_next = head->next;
-    return (!list_empty(head) && !list_is_singular(head) &&
-            head_next->next == head->prev);
+    if (!cur[i] || !cur[j])
+        return cur[i] && !cur[j];
+    int cmp = cmp_elements(cur[i], cur[j], descend);
+    return cmp < 0 || (cmp == 0 && i < j);
 }
 
-void _q_merge(struct list_head *head,
-              bool descend,
-              bool is_final,
-              struct list_head *empty_head)
+/* Merge the n <= MERGE_WAYS queues of group into the first one through a
+ * loser tree. Each output node costs log2(n) comparisons, replayed along the
+ * path from the leaf of the winning queue to the root.
+ */
+void merge_group(queue_contex_t **group, int n, bool descend)
 {
-    struct list_head *first, *second;
-    queue_contex_t *ctx1, *ctx2;
-
-    first = head->next;
-    list_del(first);
-    ctx1 = ctx_entry(first);
-    break_circular(ctx1->q);
+    struct list_head *cur[MERGE_WAYS] = {NULL};
+    int loser[MERGE_WAYS], winner[2 * MERGE_WAYS];
+    int leaves = 1, size = 0;
+
+    while (leaves < n)
+        leaves *= 2;
+    for (int i = 0; i < n; i++) {
+        struct list_head *q = group[i]->q;
+        if (list_empty(q))
+            continue;
+        break_circular(q);
+        cur[i] = q->next;
+        size += q_header(q)->size;
+    }
 
-    second = head->next;
-    list_del(second);
-    ctx2 = ctx_entry(second);
-    break_circular(ctx2->q);
+    /* Play the initial tournament, recording the loser of each match */
+    for (int i = 0; i < leaves; i++)
+        winner[leaves + i] = i;
+    for (int node = leaves - 1; node > 0; node--) {
+        int a = winner[2 * node], b = winner[2 * node + 1];
+        bool a_wins = source_before(cur, a, b, descend);
+        winner[node] = a_wins ? a : b;
+        loser[node] = a_wins ? b : a;
+    }
 
-    // if (is_final) {
-    merge_final(descend, ctx1->q, ctx1->q->next, ctx2->q->next);
-    // } else {
-    //     ctx1->q->next = merge(descend, ctx1->q->next, ctx2->q->next);
-    // }
-    ctx1->size += ctx2->size;
-    ctx2->q->next = ctx2->q;
-    ctx2->q->prev = ctx2->q;
-    ctx2->size = 0;
-    list_add(&ctx2->chain, empty_head);
+    struct list_head *first = NULL, **tail = &first;
+    for (int w = winner[1]; cur[w];) {
+        *tail = cur[w];
+        tail = &cur[w]->next;
+        cur[w] = cur[w]->next;
+        for (int node = (leaves + w) / 2; node > 0; node /= 2) {
+            if (source_before(cur, loser[node], w, descend)) {
+                int t = loser[node];
+                loser[node] = w;
+                w = t;
+            }
+        }
+    }
 
-    list_add(&ctx1->chain, head);
+    for (int i = 1; i < n; i++) {
+        INIT_LIST_HEAD(group[i]->q);
+        q_header(group[i]->q)->size = 0;
+        group[i]->size = 0;
+    }
+    rebuild_prev(group[0]->q, first);
+    q_header(group[0]->q)->size = size;
+    group[0]->size = size;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -467,13 +940,27 @@ int q_merge(struct list_head *head, bool descend)
     if (!head || list_empty(head))
         return 0;
 
-    LIST_HEAD(empty_head);
-    while (!list_is_2(head)) {
-        _q_merge(head, descend, false, &empty_head);
+    int k = 0;
+    struct list_head *node;
+    list_for_each (node, head)
+        k++;
+
+    /* Every pass merges up to MERGE_WAYS queues, stride apart in the chain,
+     * into the first of them.
+     */
+    for (long stride = 1; stride < k; stride *= MERGE_WAYS) {
+        node = head->next;
+        while (node != head) {
+            queue_contex_t *group[MERGE_WAYS];
+            int n = 0;
+            while (node != head && n < MERGE_WAYS) {
+                group[n++] = ctx_entry(node);
+                for (long i = 0; i < stride && node != head; i++)
+                    node = node->next;
+            }
+            if (n > 1)
+                merge_group(group, n, descend);
+        }
     }
-    _q_merge(head, descend, true, &empty_head);
-
-    list_splice_tail(&empty_head, head);
-    const queue_contex_t *merged_ctx = ctx_entry(head->next);
-    return merged_ctx->size;
+    return q_size(ctx_entry(head->next)->q);
 }
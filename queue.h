@@ -9,20 +9,51 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/**
+ * queue_t - Header of a queue
+ * @head: sentinel node of the circular doubly-linked list
+ * @size: the number of elements linked into @head
+ *
+ * q_new() returns &queue_t.head, so the q_* operations keep taking plain
+ * struct list_head pointers and recover the header with container_of() to
+ * keep @size up to date. @head must stay the first member.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+} queue_t;
+
+/* Bytes of string storage embedded in each element, sized so that an element
+ * fills a 64-byte cache line.
+ */
+#define ELEMENT_INLINE_SIZE \
+    (64 - sizeof(char *) - sizeof(struct list_head) - sizeof(uint64_t))
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @prefix: first 8 bytes of the string, big-endian and zero padded
+ * @inline_value: storage for strings shorter than ELEMENT_INLINE_SIZE
+ *
+ * Short strings are copied into @inline_value and @value points at it, so
+ * the element and its string come from a single allocation. Longer strings
+ * live in a separately allocated block, which must be freed along with the
+ * element. Always go through @value to read the string.
  *
- * @value needs to be explicitly allocated and freed
+ * Comparing @prefix as an integer orders elements the same way strcmp()
+ * orders their first 8 bytes, so most comparisons never load the string.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t prefix;
+    char inline_value[ELEMENT_INLINE_SIZE];
 } element_t;
 
 /**
@@ -60,7 +91,8 @@ void q_free(struct list_head *head);
  * @s: string would be inserted
  *
  * Argument s points to the string to be stored.
- * The function must explicitly allocate space and copy the string into it.
+ * The function must copy the string into the new element, either inline or
+ * into an explicitly allocated block when it does not fit.
  *
  * Return: true for success, false for allocation failed or queue is NULL
  */
@@ -72,12 +104,42 @@ bool q_insert_head(struct list_head *head, char *s);
  * @s: string would be inserted
  *
  * Argument s points to the string to be stored.
- * The function must explicitly allocate space and copy the string into it.
+ * The function must copy the string into the new element, either inline or
+ * into an explicitly allocated block when it does not fit.
  *
  * Return: true for success, false for allocation failed or queue is NULL
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert a batch of elements at the head
+ * @head: header of queue
+ * @strings: array of strings would be inserted
+ * @n: number of strings in @strings
+ *
+ * Has the same effect as calling q_insert_head() on strings[0] to
+ * strings[n - 1] in turn, so strings[n - 1] ends up at the head. The elements
+ * are built on a private list which is spliced into the queue at once.
+ * Insertion stops at the first string whose element cannot be allocated.
+ *
+ * Return: the number of leading strings inserted. A value less than @n means
+ * strings[return value] could not be inserted.
+ */
+int q_insert_head_bulk(struct list_head *head, char **strings, int n);
+
+/**
+ * q_insert_tail_bulk() - Insert a batch of elements at the tail
+ * @head: header of queue
+ * @strings: array of strings would be inserted
+ * @n: number of strings in @strings
+ *
+ * Has the same effect as calling q_insert_tail() on strings[0] to
+ * strings[n - 1] in turn. See q_insert_head_bulk().
+ *
+ * Return: the number of leading strings inserted
+ */
+int q_insert_tail_bulk(struct list_head *head, char **strings, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -116,7 +178,8 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
+    if (e->value != e->inline_value)
+        test_free(e->value);
     test_free(e);
 }
 
@@ -124,6 +187,9 @@ static inline void q_release_element(element_t *e)
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The element count is maintained by every q_* operation which links or
+ * unlinks elements, so this runs in constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -171,7 +237,8 @@ void q_swap(struct list_head *head);
  * No effect if queue is NULL or empty.
  * This function should not allocate or free any list elements
  * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
- * It should rearrange the existing ones.
+ * It should rearrange the existing ones. Strings may be stored inside their
+ * elements, so the nodes must be relinked rather than swapping @value.
  */
 void q_reverse(struct list_head *head);
 
@@ -190,11 +257,27 @@ void q_reverse(struct list_head *head);
  */
 void q_reverseK(struct list_head *head, int k);
 
+/* Sort engines selectable through sort_algo */
+#define SORT_MERGE 0
+#define SORT_RADIX 1
+
+/* Engine used by q_sort(), SORT_MERGE unless set otherwise */
+extern int sort_algo;
+
+/* Threads q_sort() may use on long queues, 1 to sort sequentially */
+extern int sort_threads;
+
 /**
  * q_sort() - Sort elements of queue in ascending/descending order
  * @head: header of queue
  * @descend: whether or not to sort in descending order
  *
+ * Both engines are stable. SORT_MERGE is an adaptive merge sort which is
+ * fast on presorted input; SORT_RADIX is an MSD radix sort over the bytes
+ * of the strings. With sort_threads above 1, long queues are cut into that
+ * many segments which are sorted and then merged concurrently; the result
+ * is the same as that of the sequential sort.
+ *
  * No effect if queue is NULL or empty. If there has only one element, do
  * nothing.
  */
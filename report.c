@@ -1,5 +1,6 @@
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,8 +13,6 @@
 #include "report.h"
 #include "web.h"
 
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
@@ -184,7 +183,7 @@ static void fail_fun(const char *format, const char *msg)
 }
 
 /* Maximum number of megabytes that application can use (0 = unlimited) */
-static int mblimit = 0;
+int mblimit = 0;
 
 /* Keeping track of memory allocation */
 static size_t allocate_cnt = 0;
@@ -192,19 +191,99 @@ static size_t allocate_bytes = 0;
 static size_t free_cnt = 0;
 static size_t free_bytes = 0;
 
-/* Counters giving peak memory usage */
-static size_t peak_bytes = 0;
-static size_t last_peak_bytes = 0;
-static size_t current_bytes = 0;
+/* Memory allocated here and through the test harness */
+mem_account_t mem_total = {0};
+
+/* Whether accounts may be charged by several threads at once */
+static bool mem_shared = false;
+
+void mem_set_shared(bool shared)
+{
+    mem_shared = shared;
+}
+
+/* Add bytes to account unless it would exceed limit (0 = unlimited) */
+static bool account_charge(mem_account_t *account, size_t bytes, size_t limit)
+{
+    size_t cur = atomic_load_explicit(&account->bytes, memory_order_relaxed);
+    size_t next;
+    do {
+        next = cur + bytes;
+        if (limit && next > limit)
+            return false;
+        if (!mem_shared) {
+            atomic_store_explicit(&account->bytes, next, memory_order_relaxed);
+            break;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &account->bytes, &cur, next, memory_order_relaxed,
+        memory_order_relaxed));
+
+    size_t peak = atomic_load_explicit(&account->peak, memory_order_relaxed);
+    while (next > peak) {
+        if (!mem_shared) {
+            atomic_store_explicit(&account->peak, next, memory_order_relaxed);
+            break;
+        }
+        if (atomic_compare_exchange_weak_explicit(&account->peak, &peak, next,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+    }
+    return true;
+}
+
+static void account_release(mem_account_t *account, size_t bytes)
+{
+    if (mem_shared)
+        atomic_fetch_sub_explicit(&account->bytes, bytes,
+                                  memory_order_relaxed);
+    else
+        atomic_store_explicit(
+            &account->bytes,
+            atomic_load_explicit(&account->bytes, memory_order_relaxed) -
+                bytes,
+            memory_order_relaxed);
+}
+
+bool mem_charge(mem_account_t *account, size_t bytes)
+{
+    if (!account_charge(&mem_total, bytes, (size_t) mblimit << 20))
+        return false;
+    if (account && !account_charge(account, bytes, account->limit)) {
+        account_release(&mem_total, bytes);
+        return false;
+    }
+    return true;
+}
+
+void mem_release(mem_account_t *account, size_t bytes)
+{
+    account_release(&mem_total, bytes);
+    while (account && account->merged)
+        account = account->merged;
+    if (account)
+        account_release(account, bytes);
+}
+
+void mem_transfer(mem_account_t *to, mem_account_t *from)
+{
+    size_t bytes = atomic_exchange(&from->bytes, 0);
+    account_charge(to, bytes, 0);
+    from->merged = to;
+}
+
+void mem_reset_peak(mem_account_t *account)
+{
+    account->peak = atomic_load(&account->bytes);
+}
 
 static void check_exceed(size_t new_bytes)
 {
-    size_t limit_bytes = (size_t) mblimit << 20;
-    size_t request_bytes = new_bytes + current_bytes;
-    if (mblimit > 0 && request_bytes > limit_bytes) {
+    if (!mem_charge(NULL, new_bytes)) {
         report_event(MSG_FATAL,
                      "Exceeded memory limit of %u megabytes with %lu bytes",
-                     mblimit, request_bytes);
+                     mblimit, mem_total.bytes + new_bytes);
     }
 }
 
@@ -220,9 +299,6 @@ void *malloc_or_fail(size_t bytes, const char *fun_name)
 
     allocate_cnt++;
     allocate_bytes += bytes;
-    current_bytes += bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
 
     return p;
 }
@@ -239,9 +315,6 @@ void *calloc_or_fail(size_t cnt, size_t bytes, const char *fun_name)
 
     allocate_cnt++;
     allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
 
     return p;
 }
@@ -259,9 +332,6 @@ char *strsave_or_fail(const char *s, const char *fun_name)
 
     allocate_cnt++;
     allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
 
     return strncpy(ss, s, len + 1);
 }
@@ -275,7 +345,7 @@ void free_block(void *b, size_t bytes)
 
     free_cnt++;
     free_bytes += bytes;
-    current_bytes -= bytes;
+    mem_release(NULL, bytes);
 }
 
 /* Free array, as from calloc */
@@ -287,7 +357,7 @@ void free_array(void *b, size_t cnt, size_t bytes)
 
     free_cnt++;
     free_bytes += cnt * bytes;
-    current_bytes -= cnt * bytes;
+    mem_release(NULL, cnt * bytes);
 }
 
 /* Free string saved by strsave_or_fail */
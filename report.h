@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +27,43 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Memory accounting, shared by the allocations below and the test harness.
+ * An account holds the bytes charged to it, their high-water mark, and an
+ * optional cap.
+ */
+typedef struct __mem_account {
+    _Atomic size_t bytes, peak;
+    size_t limit;                  /* 0 for none */
+    struct __mem_account *merged; /* Account its bytes were moved to */
+} mem_account_t;
+
+/* Maximum number of megabytes that the program can use (0 = unlimited) */
+extern int mblimit;
+
+/* All the memory accounted for */
+extern mem_account_t mem_total;
+
+/* Charge bytes to account, which may be NULL, and to the total.  Fail
+ * without charging anything when either cap would be exceeded.
+ */
+bool mem_charge(mem_account_t *account, size_t bytes);
+
+/* Undo a charge of bytes to account, or to where its bytes were moved, and
+ * to the total
+ */
+void mem_release(mem_account_t *account, size_t bytes);
+
+/* Move all the bytes charged to from over to account to, along with the
+ * bytes released against from later on
+ */
+void mem_transfer(mem_account_t *to, mem_account_t *from);
+
+/* Restart the high-water mark of account from its current bytes */
+void mem_reset_peak(mem_account_t *account);
+
+/* Allow accounts to be charged by several threads at once */
+void mem_set_shared(bool shared);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
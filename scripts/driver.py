@@ -35,7 +35,21 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-slab",
+        19: "trace-19-radix",
+        20: "trace-20-threads",
+        21: "trace-21-merge",
+        22: "trace-22-cautious",
+        23: "trace-23-guard",
+        24: "trace-24-memstat",
+        25: "trace-25-faults",
+        26: "trace-26-timeout",
+        27: "trace-27-watchdog",
+        28: "trace-28-qlimit",
+        29: "trace-29-hugearena",
+        30: "trace-30-fit",
+        31: "trace-31-linear"
     }
 
     traceProbs = {
@@ -55,10 +69,24 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -110,7 +138,8 @@ class Tracer:
         score = 0
         maxscore = 0
         if self.useValgrind:
-            self.command = ['valgrind', self.qtest]
+            # Operations run too slowly under Valgrind to be timed
+            self.command = ['valgrind', self.qtest, '-t', '0']
         else:
             self.command = [self.qtest]
         for t in tidList:
@@ -0,0 +1,26 @@
+# Test of the slab allocator, mixed with blocks too large for its slots
+option fail 50
+option malloc 0
+option slab 1
+new
+ih RAND 5000
+ih dolphin 1000
+it a_string_long_enough_to_need_a_block_larger_than_any_slab_slot 100
+rh dolphin
+rt a_string_long_enough_to_need_a_block_larger_than_any_slab_slot
+reverse
+sort
+dedup
+# Blocks from the slabs are freed fine once the slabs are off
+option slab 0
+it gerbil 100
+new
+ih bear 500
+option slab 1
+it meerkat 500
+free
+prev
+option malloc 25
+it gerbil 20
+option malloc 0
+free
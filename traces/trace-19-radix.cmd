@@ -0,0 +1,23 @@
+# Test of the radix sort, with duplicates and prefixes longer than 8 bytes
+option fail 0
+option malloc 0
+option sortalgo 1
+new
+ih RAND 20000
+ih gerbil 300
+it gerbil 300
+ih aaaaaaaaaaaaaaab 100
+it aaaaaaaaaaaaaaaa 100
+ih aaaaaaaaaaaaaaab 100
+it a 50
+ih ab 50
+sort
+rh a
+option descend 1
+sort
+rt a
+option descend 0
+reverse
+sort
+rh a
+free
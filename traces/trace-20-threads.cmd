@@ -0,0 +1,22 @@
+# Test of sorting on several threads, with duplicates across the segments
+option fail 0
+option malloc 0
+option sortthreads 4
+new
+ih RAND 40000
+ih gerbil 2000
+it gerbil 2000
+it a 10
+ih dolphin 1000
+sort
+rh a
+option descend 1
+sort
+rt a
+option descend 0
+option sortthreads 3
+option sortalgo 1
+reverse
+sort
+rh a
+free
@@ -0,0 +1,814 @@
+# Test of merging more queues than the loser tree has ways, with duplicates
+option fail 0
+option malloc 0
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+ih a
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+merge
+size
+rh a
+free
+option descend 1
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+ih a
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+new
+ih RAND 8
+it gerbil 2
+sort
+merge
+size
+rt a
+free
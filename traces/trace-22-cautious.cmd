@@ -0,0 +1,25 @@
+# Test of freeing blocks in all sorts of orders while many are live
+option fail 0
+option malloc 0
+new
+ih RAND 90000
+it gerbil 1000
+dm
+sort
+dedup
+descend
+new
+ih dolphin 50000
+option slab 1
+it bear 50000
+reverse
+rh bear
+rt dolphin
+swap
+dm
+reverseK 7
+prev
+ascend
+free
+free
+option slab 0
@@ -0,0 +1,21 @@
+# Test of queue operations on blocks placed against guard pages
+option fail 0
+option malloc 0
+option guard 1
+new
+ih RAND 2000
+ih dolphin 100
+it a_string_long_enough_to_need_more_than_one_small_block_of_the_guard_mode 10
+option length 8
+rh dolphin
+option length 1024
+rt a_string_long_enough_to_need_more_than_one_small_block_of_the_guard_mode
+sort
+dedup
+reverseK 3
+swap
+dm
+# Guarded blocks are freed fine once guarding is off
+option guard 0
+it gerbil 100
+free
@@ -0,0 +1,22 @@
+# Test of allocation statistics, with and without call sites
+option fail 0
+option malloc 0
+option memsites 1
+new
+ih RAND 1000
+it a_string_long_enough_to_need_a_block_of_its_own_size_class 10
+option slab 1
+ih dolphin 100
+new
+ih bear 100
+memstat reset
+dm
+free
+option memsites 0
+option slab 0
+prev
+sort
+dedup
+memstat
+free
+memstat
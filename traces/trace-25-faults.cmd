@@ -0,0 +1,19 @@
+# Test of malloc failures on a schedule, and replayed from a seed
+option fail 100
+option malloc 0
+new
+option failevery 3
+ih gerbil 30
+option failevery 0
+option failafter 5
+it bear 20
+option failafter 0
+option failseed 42
+option malloc 30
+ih dolphin 20
+it meerkat 20
+option malloc 0
+option failseed 0
+sort
+dedup
+free
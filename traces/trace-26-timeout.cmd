@@ -0,0 +1,10 @@
+# Test recovery from a command exceeding the time limit
+option fail 0
+option malloc 0
+option timelimit 1
+new
+ih RAND 100000000
+size
+it gerbil
+rh
+free
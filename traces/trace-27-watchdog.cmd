@@ -0,0 +1,14 @@
+# Test of the time limit firing on consecutive commands and being changed
+option fail 0
+option malloc 0
+option timelimit 1
+new
+ih RAND 100000000
+it RAND 100000000
+size
+option timelimit 0
+ih gerbil 100000
+option timelimit 2
+it RAND 100000000
+rh gerbil
+free
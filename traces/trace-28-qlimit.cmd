@@ -0,0 +1,16 @@
+# Test of insertions failing at the per-queue memory cap
+option fail 100
+option malloc 0
+option qlimit 2048
+new
+ih gerbil 50
+size
+new
+it bear 10
+merge
+it bear 5
+option qlimit 0
+it bear 20
+size
+sort
+free
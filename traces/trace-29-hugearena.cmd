@@ -0,0 +1,23 @@
+# Test of allocations served from the huge page backed arena
+option fail 0
+option malloc 0
+option hugearena 1
+new
+ih RAND 90000
+it a_string_too_long_to_be_kept_inside_the_element 1000
+reverse
+sort
+rh a_string_too_long_to_be_kept_inside_the_element
+rt
+new
+it RAND 50000
+option hugearena 0
+ih dolphin 1000
+sort
+merge
+dedup
+free
+option hugearena 1
+new
+ih gerbil 100000
+free
@@ -0,0 +1,8 @@
+# Test of the growth rates fitted to timings of queue operations
+option fail 0
+option malloc 0
+complexity sort nlogn
+complexity dm n
+complexity reverse n
+complexity ih 1
+complexity rh 1
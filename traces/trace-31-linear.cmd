@@ -0,0 +1,6 @@
+# Test of the growth rates fitted to linear queue operations
+option fail 0
+option malloc 0
+complexity free n
+complexity ascend n
+complexity descend n